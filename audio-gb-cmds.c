@@ -8,6 +8,8 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/scatterlist.h>
 
 #include "greybus.h"
 #include "audio.h"
@@ -164,25 +166,108 @@ int gb_i2s_mgmt_set_cfg(struct gb_snd *snd_dev, int rate, int chans,
 	return ret;
 }
 
-int gb_i2s_send_data(struct gb_connection *connection,
-					void *req_buf, void *source_addr,
-					size_t len, int sample_num)
+/*
+ * Fill out a short message by repeating its last sample, doubling the
+ * run copied each time.
+ */
+static void gb_i2s_send_data_pad(u8 *data, size_t len)
+{
+	size_t start;
+	size_t n;
+
+	if (len < SAMPLE_SIZE) {
+		memset(data + len, 0, MAX_SEND_DATA_LEN - len);
+		return;
+	}
+
+	start = len - SAMPLE_SIZE;
+	while (len < MAX_SEND_DATA_LEN) {
+		n = min_t(size_t, len - start, MAX_SEND_DATA_LEN - len);
+		memcpy(data + len, data + start, n);
+		len += n;
+	}
+}
+
+/*
+ * Build a message of samples from the len bytes at offset in the pcm
+ * ring, wrapping round to its start if need be.
+ *
+ * A full message is sent straight out of the ring, so the data must
+ * stay put until the operation completes.  Only a ring smaller than a
+ * message is copied (and padded) instead.  Either way the operation is
+ * finished with gb_i2s_send_data_release().
+ */
+struct gb_operation *gb_i2s_send_data_create(struct gb_connection *connection,
+					     void *ring, size_t ring_size,
+					     size_t offset, size_t len,
+					     int sample_num)
 {
 	struct gb_i2s_send_data_request *gb_req;
-	int ret;
+	struct gb_operation *operation;
+	struct scatterlist *sg;
+	size_t first = min(len, ring_size - offset);
+
+	if (len < MAX_SEND_DATA_LEN) {
+		operation = gb_operation_create(connection,
+						GB_I2S_DATA_TYPE_SEND_DATA,
+						SEND_DATA_BUF_LEN, 0,
+						GFP_KERNEL);
+		if (!operation)
+			return NULL;
+
+		gb_req = operation->request->payload;
+		memcpy(gb_req->data, ring + offset, first);
+		memcpy(gb_req->data + first, ring, len - first);
+		gb_i2s_send_data_pad(gb_req->data, len);
+	} else {
+		sg = kmalloc_array(2, sizeof(*sg), GFP_KERNEL);
+		if (!sg)
+			return NULL;
+
+		operation = gb_operation_create_sg(connection,
+						   GB_I2S_DATA_TYPE_SEND_DATA,
+						   sizeof(*gb_req),
+						   MAX_SEND_DATA_LEN, 0, 0,
+						   GFP_KERNEL);
+		if (!operation) {
+			kfree(sg);
+			return NULL;
+		}
+
+		if (first < MAX_SEND_DATA_LEN) {
+			sg_init_table(sg, 2);
+			sg_set_buf(&sg[1], ring, MAX_SEND_DATA_LEN - first);
+		} else {
+			sg_init_table(sg, 1);
+		}
+		sg_set_buf(&sg[0], ring + offset, first);
+		gb_message_set_sg(operation->request, sg,
+				  first < MAX_SEND_DATA_LEN ? 2 : 1);
+		gb_operation_set_data(operation, sg);
+
+		gb_req = operation->request->payload;
+	}
 
-	gb_req = req_buf;
 	gb_req->sample_number = cpu_to_le32(sample_num);
+	gb_req->size = cpu_to_le32(MAX_SEND_DATA_LEN);
 
-	memcpy((void *)&gb_req->data[0], source_addr, len);
-
-	if (len < MAX_SEND_DATA_LEN)
-		for (; len < MAX_SEND_DATA_LEN; len++)
-			gb_req->data[len] = gb_req->data[len - SAMPLE_SIZE];
+	return operation;
+}
 
-	gb_req->size = cpu_to_le32(len);
+/*
+ * Send a message of samples without waiting for it to be acknowledged.
+ * The callback is called once it has been, and must finish with
+ * gb_i2s_send_data_release().  If sending fails, the caller releases the
+ * operation instead.
+ */
+int gb_i2s_send_data(struct gb_operation *operation,
+		     gb_operation_callback callback)
+{
+	return gb_operation_request_send(operation, callback, GFP_KERNEL);
+}
 
-	ret = gb_operation_sync(connection, GB_I2S_DATA_TYPE_SEND_DATA,
-				(void *) gb_req, SEND_DATA_BUF_LEN, NULL, 0);
-	return ret;
+void gb_i2s_send_data_release(struct gb_operation *operation)
+{
+	kfree(gb_operation_get_data(operation));
+	gb_operation_put(operation);
 }
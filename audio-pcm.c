@@ -14,6 +14,9 @@
 #include <linux/platform_device.h>
 #include <linux/workqueue.h>
 #include <linux/i2c.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
@@ -33,61 +36,176 @@
  * However since the hrtimer runs in irq context, so we
  * have to schedule a workqueue to actually send the
  * greybus data.
+ *
+ * Messages are sent without waiting for the module to acknowledge
+ * them, so a slow round trip doesn't hold up the next period.  Up to
+ * GB_AUDIO_TX_INFLIGHT_MAX may be outstanding, fewer if the ring holds
+ * fewer messages; if that many still are when a period comes round,
+ * its message is owed and sent as soon as the window has room,
+ * alongside the message of a later period.
  */
 
-static void gb_pcm_work(struct work_struct *work)
+/* Called with snd_dev->lock held */
+static void gb_pcm_tx_track(struct gb_snd *snd_dev,
+			    struct gb_operation *operation)
 {
-	struct gb_snd *snd_dev = container_of(work, struct gb_snd, work);
-	struct snd_pcm_substream *substream = snd_dev->substream;
-	struct snd_pcm_runtime *runtime = substream->runtime;
-	unsigned int stride, frames, oldptr;
-	int period_elapsed, ret;
-	char *address;
-	long len;
+	int i;
 
-	if (!snd_dev)
-		return;
+	for (i = 0; i < GB_AUDIO_TX_INFLIGHT_MAX; i++) {
+		if (!snd_dev->tx_ops[i]) {
+			snd_dev->tx_ops[i] = operation;
+			return;
+		}
+	}
+}
 
-	if (!atomic_read(&snd_dev->running)) {
-		if (snd_dev->cport_active) {
-			ret = gb_i2s_mgmt_deactivate_cport(
-				snd_dev->mgmt_connection,
-				snd_dev->i2s_tx_connection->intf_cport_id);
-			if (ret) /* XXX Do what else with failure? */
-				pr_err("deactivate_cport failed: %d\n", ret);
+/* Called with snd_dev->lock held */
+static void gb_pcm_tx_untrack(struct gb_snd *snd_dev,
+			      struct gb_operation *operation)
+{
+	int i;
 
-			snd_dev->cport_active = false;
-			snd_dev->send_data_sample_count = 0;
+	for (i = 0; i < GB_AUDIO_TX_INFLIGHT_MAX; i++) {
+		if (snd_dev->tx_ops[i] == operation) {
+			snd_dev->tx_ops[i] = NULL;
+			return;
 		}
+	}
+}
+
+/*
+ * A message is late if it is acknowledged after the end of the period
+ * it was sent for, counted from the start of the stream.
+ */
+static void gb_pcm_send_callback(struct gb_operation *operation)
+{
+	struct gb_snd *snd_dev = operation->connection->private;
+	struct gb_i2s_send_data_request *request = operation->request->payload;
+	u32 msg = le32_to_cpu(request->sample_number) / CONFIG_SAMPLES_PER_MSG;
+	unsigned long flags;
+	ktime_t deadline;
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret)
+		pr_err_ratelimited("send data failed: %d\n", ret);
+
+	spin_lock_irqsave(&snd_dev->lock, flags);
+	gb_pcm_tx_untrack(snd_dev, operation);
+	snd_dev->tx_pending_bytes -= operation->request->sg_size;
+	deadline = ktime_add_ns(snd_dev->tx_start,
+				(u64)(msg + 1) * CONFIG_PERIOD_NS);
+	if (ret)
+		snd_dev->tx_stats.failed++;
+	else if (ktime_to_ns(ktime_get()) > ktime_to_ns(deadline))
+		snd_dev->tx_stats.late++;
+	spin_unlock_irqrestore(&snd_dev->lock, flags);
+
+	gb_i2s_send_data_release(operation);
+
+	if (atomic_dec_and_test(&snd_dev->tx_inflight))
+		wake_up(&snd_dev->tx_wq);
+}
 
+/*
+ * Wait for the messages in flight to be acknowledged, as they may point
+ * into the pcm ring.  Those the module doesn't acknowledge in time are
+ * cancelled.
+ */
+static void gb_pcm_tx_drain(struct gb_snd *snd_dev)
+{
+	struct gb_operation *operation;
+	unsigned long flags;
+	int i;
+
+	if (wait_event_timeout(snd_dev->tx_wq,
+			       !atomic_read(&snd_dev->tx_inflight),
+			       msecs_to_jiffies(GB_OPERATION_TIMEOUT_DEFAULT)))
 		return;
-	} else if (!snd_dev->cport_active) {
-		ret = gb_i2s_mgmt_activate_cport(snd_dev->mgmt_connection,
-				snd_dev->i2s_tx_connection->intf_cport_id);
-		if (ret)
-			pr_err("activate_cport failed: %d\n", ret);
 
-		snd_dev->cport_active = true;
+	for (i = 0; i < GB_AUDIO_TX_INFLIGHT_MAX; i++) {
+		spin_lock_irqsave(&snd_dev->lock, flags);
+		operation = snd_dev->tx_ops[i];
+		if (operation)
+			gb_operation_get(operation);
+		spin_unlock_irqrestore(&snd_dev->lock, flags);
+
+		if (operation) {
+			gb_operation_cancel(operation, -ETIMEDOUT);
+			gb_operation_put(operation);
+		}
+	}
+
+	wait_event(snd_dev->tx_wq, !atomic_read(&snd_dev->tx_inflight));
+}
+
+/* Record how far the time between sends strayed from the period */
+static void gb_pcm_send_stats(struct gb_snd *snd_dev)
+{
+	struct gb_audio_tx_stats *stats = &snd_dev->tx_stats;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	s64 jitter_us;
+
+	spin_lock_irqsave(&snd_dev->lock, flags);
+	if (!snd_dev->send_data_sample_count) {
+		snd_dev->tx_start = now;
+	} else {
+		jitter_us = ktime_us_delta(now, snd_dev->tx_last) -
+				CONFIG_PERIOD_NS / NSEC_PER_USEC;
+		if (jitter_us < 0)
+			jitter_us = -jitter_us;
+		stats->jitter_us += jitter_us;
+		stats->jitter_max_us = max_t(u32, stats->jitter_max_us,
+					     jitter_us);
 	}
+	snd_dev->tx_last = now;
+	stats->messages++;
+	spin_unlock_irqrestore(&snd_dev->lock, flags);
+}
+
+/* Send the next message of samples and move the stream on past it */
+static void gb_pcm_send(struct gb_snd *snd_dev)
+{
+	struct snd_pcm_substream *substream = snd_dev->substream;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct gb_operation *operation;
+	unsigned int stride, frames, oldptr;
+	int period_elapsed = 0, ret;
+	unsigned long flags;
+	long ring, len;
 
-	address = runtime->dma_area + snd_dev->hwptr_done;
+	/* Full messages are sent from the ring, wrapping round its end */
+	ring = frames_to_bytes(runtime, runtime->buffer_size);
+	len = min(ring, MAX_SEND_DATA_LEN);
 
-	len = frames_to_bytes(runtime,
-			      runtime->buffer_size) - snd_dev->hwptr_done;
-	len = min(len, MAX_SEND_DATA_LEN);
-	gb_i2s_send_data(snd_dev->i2s_tx_connection, snd_dev->send_data_req_buf,
-				address, len, snd_dev->send_data_sample_count);
+	gb_pcm_send_stats(snd_dev);
+	operation = gb_i2s_send_data_create(snd_dev->i2s_tx_connection,
+					    runtime->dma_area, ring,
+					    snd_dev->hwptr_done, len,
+					    snd_dev->send_data_sample_count);
 
+	/* The stream moves on whether or not the data made it */
 	snd_dev->send_data_sample_count += CONFIG_SAMPLES_PER_MSG;
 
 	stride = runtime->frame_bits >> 3;
-	frames = len/stride;
 
+	/*
+	 * The pointer callback reads hwptr_done and tx_pending_bytes
+	 * together, so both move in the same critical section.
+	 */
 	snd_pcm_stream_lock(substream);
+	spin_lock_irqsave(&snd_dev->lock, flags);
+	if (operation) {
+		gb_pcm_tx_track(snd_dev, operation);
+		snd_dev->tx_pending_bytes += operation->request->sg_size;
+	}
+
 	oldptr = snd_dev->hwptr_done;
 	snd_dev->hwptr_done += len;
 	if (snd_dev->hwptr_done >= runtime->buffer_size * stride)
 		snd_dev->hwptr_done -= runtime->buffer_size * stride;
+	spin_unlock_irqrestore(&snd_dev->lock, flags);
 
 	frames = (len + (oldptr % stride)) / stride;
 
@@ -98,10 +216,95 @@ static void gb_pcm_work(struct work_struct *work)
 	}
 
 	snd_pcm_stream_unlock(substream);
+
+	if (!operation) {
+		ret = -ENOMEM;
+	} else {
+		atomic_inc(&snd_dev->tx_inflight);
+		ret = gb_i2s_send_data(operation, gb_pcm_send_callback);
+	}
+	if (ret) {
+		pr_err_ratelimited("send data failed: %d\n", ret);
+
+		/* Only ever moves the pointer forward */
+		spin_lock_irqsave(&snd_dev->lock, flags);
+		if (operation) {
+			gb_pcm_tx_untrack(snd_dev, operation);
+			snd_dev->tx_pending_bytes -=
+					operation->request->sg_size;
+		}
+		snd_dev->tx_stats.failed++;
+		spin_unlock_irqrestore(&snd_dev->lock, flags);
+
+		if (operation) {
+			gb_i2s_send_data_release(operation);
+			atomic_dec(&snd_dev->tx_inflight);
+		}
+	}
+
 	if (period_elapsed)
 		snd_pcm_period_elapsed(snd_dev->substream);
 }
 
+static void gb_pcm_work(struct work_struct *work)
+{
+	struct gb_snd *snd_dev = container_of(work, struct gb_snd, work);
+	struct snd_pcm_runtime *runtime;
+	unsigned long flags;
+	unsigned int sends;
+	int window, ret;
+
+	if (!snd_dev)
+		return;
+
+	if (!atomic_read(&snd_dev->running)) {
+		if (snd_dev->cport_active) {
+			gb_pcm_tx_drain(snd_dev);
+
+			ret = gb_i2s_mgmt_deactivate_cport(
+				snd_dev->mgmt_connection,
+				snd_dev->i2s_tx_connection->intf_cport_id);
+			if (ret) /* XXX Do what else with failure? */
+				pr_err("deactivate_cport failed: %d\n", ret);
+
+			snd_dev->cport_active = false;
+			snd_dev->send_data_sample_count = 0;
+			snd_dev->tx_owed = 0;
+		}
+
+		return;
+	} else if (!snd_dev->cport_active) {
+		ret = gb_i2s_mgmt_activate_cport(snd_dev->mgmt_connection,
+				snd_dev->i2s_tx_connection->intf_cport_id);
+		if (ret)
+			pr_err("activate_cport failed: %d\n", ret);
+
+		snd_dev->cport_active = true;
+	}
+
+	/*
+	 * Messages in flight are still counted in the ring, so no more of
+	 * them may be outstanding than the ring holds.
+	 */
+	runtime = snd_dev->substream->runtime;
+	window = clamp_t(int, frames_to_bytes(runtime, runtime->buffer_size) /
+			 MAX_SEND_DATA_LEN, 1, GB_AUDIO_TX_INFLIGHT_MAX);
+
+	/* Catch up on periods that found the window full */
+	sends = snd_dev->tx_owed + 1;
+	while (sends && atomic_read(&snd_dev->tx_inflight) < window) {
+		gb_pcm_send(snd_dev);
+		sends--;
+	}
+	snd_dev->tx_owed = sends;
+
+	if (sends) {
+		spin_lock_irqsave(&snd_dev->lock, flags);
+		snd_dev->tx_stats.stalls++;
+		spin_unlock_irqrestore(&snd_dev->lock, flags);
+	}
+}
+
 static enum hrtimer_restart gb_pcm_timer_function(struct hrtimer *hrtimer)
 {
 	struct gb_snd *snd_dev = container_of(hrtimer, struct gb_snd, timer);
@@ -128,6 +331,58 @@ void gb_pcm_hrtimer_stop(struct gb_snd *snd_dev)
 	queue_work(snd_dev->workqueue, &snd_dev->work); /* Deactivates CPort */
 }
 
+static int gb_pcm_tx_stats_show(struct seq_file *s, void *unused)
+{
+	struct gb_snd *snd_dev = s->private;
+	struct gb_audio_tx_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&snd_dev->lock, flags);
+	stats = snd_dev->tx_stats;
+	spin_unlock_irqrestore(&snd_dev->lock, flags);
+
+	seq_printf(s, "messages: %lu\n", stats.messages);
+	seq_printf(s, "failed: %lu\n", stats.failed);
+	seq_printf(s, "late: %lu\n", stats.late);
+	seq_printf(s, "stalls: %lu\n", stats.stalls);
+	seq_printf(s, "inflight: %d\n", atomic_read(&snd_dev->tx_inflight));
+	if (stats.messages > 1) {
+		seq_printf(s, "jitter_avg_us: %llu\n",
+			   div64_u64(stats.jitter_us, stats.messages - 1));
+		seq_printf(s, "jitter_max_us: %u\n", stats.jitter_max_us);
+	}
+
+	return 0;
+}
+
+static int gb_pcm_tx_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_pcm_tx_stats_show, inode->i_private);
+}
+
+static const struct file_operations gb_pcm_debugfs_tx_stats_ops = {
+	.open		= gb_pcm_tx_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void gb_pcm_debugfs_init(struct gb_snd *snd_dev)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "audio_tx_%d", snd_dev->device_count);
+	snd_dev->tx_stats_file = debugfs_create_file(name, S_IFREG | S_IRUGO,
+					gb_debugfs_get(), snd_dev,
+					&gb_pcm_debugfs_tx_stats_ops);
+}
+
+void gb_pcm_debugfs_exit(struct gb_snd *snd_dev)
+{
+	debugfs_remove(snd_dev->tx_stats_file);
+	snd_dev->tx_stats_file = NULL;
+}
+
 static int gb_pcm_hrtimer_init(struct gb_snd *snd_dev)
 {
 	hrtimer_init(&snd_dev->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
@@ -162,14 +417,27 @@ static struct snd_pcm_hardware gb_plat_pcm_hardware = {
 	.periods_max		= 32,
 };
 
+/*
+ * Samples still referenced by messages in flight are not reported as
+ * played, so they aren't overwritten before they have been sent.
+ */
 static snd_pcm_uframes_t gb_pcm_pointer(struct snd_pcm_substream *substream)
 {
 	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct gb_snd *snd_dev;
+	unsigned long flags;
+	int ptr;
 
 	snd_dev = snd_soc_dai_get_drvdata(rtd->cpu_dai);
 
-	return snd_dev->hwptr_done  / (substream->runtime->frame_bits >> 3);
+	spin_lock_irqsave(&snd_dev->lock, flags);
+	ptr = snd_dev->hwptr_done - snd_dev->tx_pending_bytes;
+	spin_unlock_irqrestore(&snd_dev->lock, flags);
+	if (ptr < 0)
+		ptr += frames_to_bytes(runtime, runtime->buffer_size);
+
+	return ptr / (runtime->frame_bits >> 3);
 }
 
 static int gb_pcm_prepare(struct snd_pcm_substream *substream)
@@ -178,6 +446,10 @@ static int gb_pcm_prepare(struct snd_pcm_substream *substream)
 	struct gb_snd *snd_dev;
 
 	snd_dev = snd_soc_dai_get_drvdata(rtd->cpu_dai);
+
+	/* Let a stop finish draining the messages before starting over */
+	flush_workqueue(snd_dev->workqueue);
+
 	snd_dev->hwptr_done = 0;
 	snd_dev->transfer_done = 0;
 	return 0;
@@ -251,6 +523,15 @@ static int gb_pcm_hw_params(struct snd_pcm_substream *substream,
 
 static int gb_pcm_hw_free(struct snd_pcm_substream *substream)
 {
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct gb_snd *snd_dev;
+
+	snd_dev = snd_soc_dai_get_drvdata(rtd->cpu_dai);
+
+	/* Messages in flight may still point into the buffer */
+	flush_workqueue(snd_dev->workqueue);
+	gb_pcm_tx_drain(snd_dev);
+
 	return snd_pcm_lib_free_pages(substream);
 }
 
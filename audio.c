@@ -66,6 +66,7 @@ static struct gb_snd *gb_get_snd(int bundle_id)
 		return NULL;
 
 	spin_lock_init(&snd_dev->lock);
+	init_waitqueue_head(&snd_dev->tx_wq);
 	snd_dev->device_count = device_count++;
 	snd_dev->gb_bundle_id = bundle_id;
 	spin_lock_irqsave(&gb_snd_list_lock, flags);
@@ -225,6 +226,8 @@ static int gb_i2s_transmitter_connection_init(struct gb_connection *connection)
 		goto out_card;
 	}
 
+	gb_pcm_debugfs_init(snd_dev);
+
 #if USE_RT5645
 	rt5647_info.addr = RT5647_I2C_ADDR;
 	strlcpy(rt5647_info.type, "rt5647", I2C_NAME_SIZE);
@@ -247,6 +250,7 @@ static int gb_i2s_transmitter_connection_init(struct gb_connection *connection)
 
 #if USE_RT5645
 out_get_ver:
+	gb_pcm_debugfs_exit(snd_dev);
 	platform_device_unregister(&snd_dev->card);
 #endif
 out_card:
@@ -268,6 +272,7 @@ static void gb_i2s_transmitter_connection_exit(struct gb_connection *connection)
 	i2c_unregister_device(snd_dev->rt5647);
 #endif
 
+	gb_pcm_debugfs_exit(snd_dev);
 	platform_device_unregister(&snd_dev->card);
 	platform_device_unregister(&snd_dev->cpu_dai);
 	platform_device_unregister(snd_dev->codec);
@@ -305,13 +310,6 @@ static int gb_i2s_mgmt_connection_init(struct gb_connection *connection)
 		goto err_free_i2s_configs;
 	}
 
-	snd_dev->send_data_req_buf = kzalloc(SEND_DATA_BUF_LEN, GFP_KERNEL);
-
-	if (!snd_dev->send_data_req_buf) {
-		ret = -ENOMEM;
-		goto err_free_i2s_configs;
-	}
-
 	return 0;
 
 err_free_i2s_configs:
@@ -327,9 +325,6 @@ static void gb_i2s_mgmt_connection_exit(struct gb_connection *connection)
 
 	gb_i2s_mgmt_free_cfgs(snd_dev);
 
-	kfree(snd_dev->send_data_req_buf);
-	snd_dev->send_data_req_buf = NULL;
-
 	snd_dev->mgmt_connection = NULL;
 	gb_free_snd(snd_dev);
 }
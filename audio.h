@@ -39,6 +39,18 @@
 #define SEND_DATA_BUF_LEN (sizeof(struct gb_i2s_send_data_request) + \
 				MAX_SEND_DATA_LEN)
 
+/* Sample messages sent but not yet acknowledged by the module */
+#define GB_AUDIO_TX_INFLIGHT_MAX		4
+
+struct gb_audio_tx_stats {
+	unsigned long			messages;
+	unsigned long			failed;
+	unsigned long			late;	/* acked after their period */
+	unsigned long			stalls;	/* periods the window was full */
+	u64				jitter_us;
+	u32				jitter_max_us;
+};
+
 
 /*
  * This is the gb_snd structure which ties everything together
@@ -55,8 +67,16 @@ struct gb_snd {
 	struct gb_connection		*i2s_rx_connection;
 	struct gb_i2s_mgmt_get_supported_configurations_response
 					*i2s_configs;
-	char				*send_data_req_buf;
 	long				send_data_sample_count;
+	atomic_t			tx_inflight;
+	struct gb_operation		*tx_ops[GB_AUDIO_TX_INFLIGHT_MAX];
+	wait_queue_head_t		tx_wq;	/* tx_inflight dropped to 0 */
+	unsigned int			tx_owed; /* periods not sent yet */
+	int				tx_pending_bytes; /* still in the ring */
+	ktime_t				tx_start;
+	ktime_t				tx_last;
+	struct gb_audio_tx_stats	tx_stats;
+	struct dentry			*tx_stats_file;
 	int				gb_bundle_id;
 	int				device_count;
 	struct snd_pcm_substream	*substream;
@@ -92,8 +112,13 @@ int gb_i2s_mgmt_get_cfgs(struct gb_snd *snd_dev,
 void gb_i2s_mgmt_free_cfgs(struct gb_snd *snd_dev);
 int gb_i2s_mgmt_set_cfg(struct gb_snd *snd_dev, int rate, int chans,
 			int bytes_per_chan, int is_le);
-int gb_i2s_send_data(struct gb_connection *connection, void *req_buf,
-				void *source_addr, size_t len, int sample_num);
+struct gb_operation *gb_i2s_send_data_create(struct gb_connection *connection,
+					     void *ring, size_t ring_size,
+					     size_t offset, size_t len,
+					     int sample_num);
+int gb_i2s_send_data(struct gb_operation *operation,
+		     gb_operation_callback callback);
+void gb_i2s_send_data_release(struct gb_operation *operation);
 
 
 /*
@@ -101,6 +126,8 @@ int gb_i2s_send_data(struct gb_connection *connection, void *req_buf,
  */
 void gb_pcm_hrtimer_start(struct gb_snd *snd_dev);
 void gb_pcm_hrtimer_stop(struct gb_snd *snd_dev);
+void gb_pcm_debugfs_init(struct gb_snd *snd_dev);
+void gb_pcm_debugfs_exit(struct gb_snd *snd_dev);
 
 
 /*
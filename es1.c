@@ -211,7 +211,7 @@ static int message_send(struct greybus_host_device *hd, u16 cport_id,
 	/* Pack the cport id into the message header */
 	gb_message_cport_pack(message->header, cport_id);
 
-	buffer_size = sizeof(*message->header) + message->payload_size;
+	buffer_size = gb_message_size(message);
 
 	usb_fill_bulk_urb(urb, udev,
 			  usb_sndbulkpipe(udev, es1->cport_out_endpoint),
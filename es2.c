@@ -11,6 +11,7 @@
 #include <linux/usb.h>
 #include <linux/kfifo.h>
 #include <linux/debugfs.h>
+#include <linux/scatterlist.h>
 #include <asm/unaligned.h>
 
 #include "greybus.h"
@@ -219,6 +220,12 @@ static void free_urb(struct es1_ap_dev *es1, struct urb *urb)
 {
 	unsigned long flags;
 	int i;
+
+	/* Drop any scatterlist built by cport_out_urb_set_sg() */
+	kfree(urb->sg);
+	urb->sg = NULL;
+	urb->num_sgs = 0;
+
 	/*
 	 * See if this was an urb in our pool, if so mark it "free", otherwise
 	 * we need to free it ourselves.
@@ -263,6 +270,47 @@ static u16 gb_message_cport_unpack(struct gb_operation_msg_hdr *header)
 	return cport_id;
 }
 
+/*
+ * Point the urb at the message buffer (header and payload) followed by the
+ * message's scatterlist data, so the latter needn't be copied.
+ */
+static int cport_out_urb_set_sg(struct urb *urb, struct gb_message *message,
+				gfp_t gfp_mask)
+{
+	struct scatterlist *sgl;
+	struct scatterlist *sg;
+	int i;
+
+	sgl = kmalloc_array(message->sg_nents + 1, sizeof(*sgl), gfp_mask);
+	if (!sgl)
+		return -ENOMEM;
+
+	sg_init_table(sgl, message->sg_nents + 1);
+	sg_set_buf(&sgl[0], message->buffer,
+		   gb_message_size(message) - message->sg_size);
+	for_each_sg(message->sg, sg, message->sg_nents, i)
+		sg_set_page(&sgl[i + 1], sg_page(sg), sg->length, sg->offset);
+
+	urb->transfer_buffer = NULL;
+	urb->sg = sgl;
+	urb->num_sgs = message->sg_nents + 1;
+
+	return 0;
+}
+
+/*
+ * Scatterlists are only used if the host controller can take arbitrarily
+ * sized segments, as our message header isn't a multiple of the packet size.
+ */
+static unsigned int es1_sg_tablesize(struct usb_device *udev)
+{
+#ifdef USB_BUS_HAS_NO_SG_CONSTRAINT
+	if (udev->bus->no_sg_constraint)
+		return udev->bus->sg_tablesize;
+#endif
+	return 0;
+}
+
 /*
  * Returns zero if the message was successfully queued, or a negative errno
  * otherwise.
@@ -300,7 +348,7 @@ static int message_send(struct greybus_host_device *hd, u16 cport_id,
 	/* Pack the cport id into the message header */
 	gb_message_cport_pack(message->header, cport_id);
 
-	buffer_size = sizeof(*message->header) + message->payload_size;
+	buffer_size = gb_message_size(message);
 
 	bulk_ep_set = cport_to_ep(es1, cport_id);
 	usb_fill_bulk_urb(urb, udev,
@@ -309,22 +357,29 @@ static int message_send(struct greybus_host_device *hd, u16 cport_id,
 			  message->buffer, buffer_size,
 			  cport_out_callback, message);
 	urb->transfer_flags |= URB_ZERO_PACKET;
+	if (message->sg) {
+		retval = cport_out_urb_set_sg(urb, message, gfp_mask);
+		if (retval)
+			goto err_free_urb;
+	}
 	gb_connection_push_timestamp(message->operation->connection);
 	retval = usb_submit_urb(urb, gfp_mask);
 	if (retval) {
 		pr_err("error %d submitting URB\n", retval);
+		goto err_free_urb;
+	}
 
-		spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-		message->hcpriv = NULL;
-		spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+	return 0;
 
-		free_urb(es1, urb);
-		gb_message_cport_clear(message->header);
+err_free_urb:
+	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	message->hcpriv = NULL;
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
 
-		return retval;
-	}
+	free_urb(es1, urb);
+	gb_message_cport_clear(message->header);
 
-	return 0;
+	return retval;
 }
 
 /*
@@ -706,6 +761,7 @@ static int ap_probe(struct usb_interface *interface,
 	es1->hd = hd;
 	es1->usb_intf = interface;
 	es1->usb_dev = udev;
+	hd->sg_tablesize = es1_sg_tablesize(udev);
 	spin_lock_init(&es1->cport_out_urb_lock);
 	usb_set_intfdata(interface, es1);
 
@@ -14,6 +14,10 @@
 #include <linux/irq.h>
 #include <linux/irqdomain.h>
 #include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <asm/unaligned.h>
 
 #include "greybus.h"
 
@@ -25,12 +29,32 @@ struct gb_gpio_line {
 				value:     1;	/* 0 = low, 1 = high */
 	u16			debounce_usec;
 
+	/*
+	 * Whether direction and value hold the module's state.  These are
+	 * not bitfields: value_valid is cleared by irq events while gpiolib
+	 * callers update the fields above.
+	 */
+	bool			direction_valid;
+	bool			value_valid;
+	atomic_t		events;		/* irq events received */
+
 	u8			irq_type;
 	bool			irq_type_pending;
 	bool			masked;
 	bool			masked_pending;
 };
 
+struct gb_gpio_event_stats {
+	unsigned long		messages;
+	unsigned long		events;
+	u64			dispatch_us;	/* per message */
+	u32			dispatch_max_us;
+	unsigned long		stamped;	/* events with a timestamp */
+	u64			delay_us;	/* on the module */
+	u32			delay_min_us;
+	u32			delay_max_us;
+};
+
 struct gb_gpio_controller {
 	struct gb_connection	*connection;
 	u8			line_max;	/* max line number */
@@ -44,11 +68,41 @@ struct gb_gpio_controller {
 	irq_flow_handler_t	irq_handler;
 	unsigned int		irq_default_type;
 	struct mutex		irq_lock;
+
+	bool			multiple;	/* module does multiple line ops */
+	bool			irq_configure;	/* ... and bulk irq updates */
+	bool			irq_event_multiple; /* ... and coalesced events */
+
+	atomic_long_t		cache_hits;
+	atomic_long_t		cache_misses;
+	struct dentry		*debugfs_file;
+
+	spinlock_t		stats_lock;
+	struct gb_gpio_event_stats stats;
+	struct dentry		*debugfs_events;
 };
 #define gpio_chip_to_gb_gpio_controller(chip) \
 	container_of(chip, struct gb_gpio_controller, chip)
 #define irq_data_to_gpio_chip(d) (d->domain->host_data)
 
+/* Bytes in a bitmap covering all (up to 256) lines */
+#define GB_GPIO_BITMAP_MAX	32
+
+/*
+ * Lines only change direction and output value at our request, so those
+ * can be answered from the state we last set or read.  An input's value
+ * can change at any time, and is only cached while an edge-both irq is
+ * enabled on the line, as every change then produces an event.
+ */
+static bool state_cache = true;
+module_param(state_cache, bool, 0644);
+MODULE_PARM_DESC(state_cache, "serve direction and output values from cache");
+
+static bool input_cache;
+module_param(input_cache, bool, 0644);
+MODULE_PARM_DESC(input_cache,
+		 "cache input values of lines with edge-both irqs enabled");
+
 static int gb_gpio_line_count_operation(struct gb_gpio_controller *ggc)
 {
 	struct gb_gpio_line_count_response response;
@@ -69,8 +123,11 @@ static int gb_gpio_activate_operation(struct gb_gpio_controller *ggc, u8 which)
 	request.which = which;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_ACTIVATE,
 				 &request, sizeof(request), NULL, 0);
-	if (!ret)
+	if (!ret) {
 		ggc->lines[which].active = true;
+		ggc->lines[which].direction_valid = false;
+		ggc->lines[which].value_valid = false;
+	}
 	return ret;
 }
 
@@ -114,6 +171,7 @@ static int gb_gpio_get_direction_operation(struct gb_gpio_controller *ggc,
 			 which, direction);
 	}
 	ggc->lines[which].direction = direction ? 1 : 0;
+	ggc->lines[which].direction_valid = true;
 	return 0;
 }
 
@@ -124,10 +182,13 @@ static int gb_gpio_direction_in_operation(struct gb_gpio_controller *ggc,
 	int ret;
 
 	request.which = which;
+	ggc->lines[which].value_valid = false;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_DIRECTION_IN,
 				&request, sizeof(request), NULL, 0);
-	if (!ret)
+	if (!ret) {
 		ggc->lines[which].direction = 1;
+		ggc->lines[which].direction_valid = true;
+	}
 	return ret;
 }
 
@@ -139,10 +200,15 @@ static int gb_gpio_direction_out_operation(struct gb_gpio_controller *ggc,
 
 	request.which = which;
 	request.value = value_high ? 1 : 0;
+	ggc->lines[which].value_valid = false;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_DIRECTION_OUT,
 				&request, sizeof(request), NULL, 0);
-	if (!ret)
+	if (!ret) {
 		ggc->lines[which].direction = 0;
+		ggc->lines[which].direction_valid = true;
+		ggc->lines[which].value = request.value;
+		ggc->lines[which].value_valid = true;
+	}
 	return ret;
 }
 
@@ -197,6 +263,7 @@ static void gb_gpio_set_value_operation(struct gb_gpio_controller *ggc,
 	}
 
 	ggc->lines[which].value = request.value;
+	ggc->lines[which].value_valid = true;
 }
 
 static int gb_gpio_set_debounce_operation(struct gb_gpio_controller *ggc,
@@ -256,6 +323,11 @@ static void _gb_gpio_irq_set_type(struct gb_gpio_controller *ggc,
 		dev_err(ggc->chip.dev, "failed to set irq type: %d\n", ret);
 }
 
+static bool gb_gpio_bitmap_test(u8 *buf, unsigned int bit)
+{
+	return buf[bit / 8] & BIT(bit % 8);
+}
+
 static void gb_gpio_irq_mask(struct irq_data *d)
 {
 	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
@@ -321,12 +393,93 @@ static void gb_gpio_irq_bus_lock(struct irq_data *d)
 	mutex_lock(&ggc->irq_lock);
 }
 
+/*
+ * Send the pending irq type and mask changes of all lines in a single
+ * operation.
+ */
+static void gb_gpio_irq_configure_operation(struct gb_gpio_controller *ggc)
+{
+	struct gb_gpio_irq_configure_request *request;
+	struct gb_operation *operation;
+	unsigned int lines = ggc->line_max + 1;
+	unsigned int size = DIV_ROUND_UP(lines, 8);
+	struct gb_gpio_line *line;
+	unsigned int types = 0;
+	bool pending = false;
+	u8 *typed, *changed, *masked, *type;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < lines; i++) {
+		line = &ggc->lines[i];
+		if (line->irq_type_pending)
+			types++;
+		if (line->irq_type_pending || line->masked_pending)
+			pending = true;
+	}
+	if (!pending)
+		return;
+
+	operation = gb_operation_create(ggc->connection,
+					GB_GPIO_TYPE_IRQ_CONFIGURE,
+					sizeof(*request) + 3 * size + types, 0,
+					GFP_KERNEL);
+	if (!operation) {
+		dev_err(ggc->chip.dev, "failed to configure irqs: %d\n",
+			-ENOMEM);
+		return;
+	}
+
+	request = operation->request->payload;
+	request->size = size;
+	typed = request->data;
+	changed = typed + size;
+	masked = changed + size;
+	type = masked + size;
+	memset(typed, 0, 3 * size);
+
+	for (i = 0; i < lines; i++) {
+		line = &ggc->lines[i];
+		if (line->irq_type_pending) {
+			typed[i / 8] |= BIT(i % 8);
+			*type++ = line->irq_type;
+		}
+		if (line->masked_pending) {
+			changed[i / 8] |= BIT(i % 8);
+			if (line->masked)
+				masked[i / 8] |= BIT(i % 8);
+		}
+	}
+
+	ret = gb_operation_request_send_sync(operation);
+	if (ret)
+		dev_err(ggc->chip.dev, "failed to configure irqs: %d\n", ret);
+
+	for (i = 0; i < lines; i++) {
+		line = &ggc->lines[i];
+		if (gb_gpio_bitmap_test(typed, i))
+			line->irq_type_pending = false;
+		if (gb_gpio_bitmap_test(changed, i))
+			line->masked_pending = false;
+		/* Events may have been missed while the irq was reconfigured */
+		if (gb_gpio_bitmap_test(typed, i) ||
+				gb_gpio_bitmap_test(changed, i))
+			line->value_valid = false;
+	}
+	gb_operation_destroy(operation);
+}
+
 static void gb_gpio_irq_bus_sync_unlock(struct irq_data *d)
 {
 	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
 	struct gb_gpio_line *line = &ggc->lines[d->hwirq];
 
+	if (ggc->irq_configure) {
+		gb_gpio_irq_configure_operation(ggc);
+		goto out_unlock;
+	}
+
 	if (line->irq_type_pending) {
 		_gb_gpio_irq_set_type(ggc, d->hwirq, line->irq_type);
 		line->irq_type_pending = false;
@@ -340,25 +493,77 @@ static void gb_gpio_irq_bus_sync_unlock(struct irq_data *d)
 		line->masked_pending = false;
 	}
 
+	/* Events may have been missed while the irq was reconfigured */
+	line->value_valid = false;
+out_unlock:
 	mutex_unlock(&ggc->irq_lock);
 }
 
-static int gb_gpio_request_recv(u8 type, struct gb_operation *op)
+static void gb_gpio_irq_dispatch(struct gb_gpio_controller *ggc, u8 which)
 {
-	struct gb_connection *connection = op->connection;
-	struct gb_gpio_controller *ggc = connection->private;
-	struct gb_message *request;
-	struct gb_gpio_irq_event_request *event;
-	int irq;
+	struct gb_gpio_line *line = &ggc->lines[which];
 	struct irq_desc *desc;
+	int irq;
 
-	if (type != GB_GPIO_TYPE_IRQ_EVENT) {
-		dev_err(&connection->dev,
-			"unsupported unsolicited request: %u\n", type);
-		return -EINVAL;
+	/*
+	 * The line may have changed; drop any cached input value.  The event
+	 * is counted first, so a racing gb_gpio_get() either sees it and
+	 * drops the value itself, or has it dropped here.
+	 */
+	smp_mb();
+	atomic_inc(&line->events);
+	smp_mb();
+	ACCESS_ONCE(line->value_valid) = false;
+
+	irq = irq_find_mapping(ggc->irqdomain, which);
+	if (!irq) {
+		dev_err(ggc->chip.dev, "failed to find IRQ\n");
+		return;
+	}
+	desc = irq_to_desc(irq);
+	if (!desc) {
+		dev_err(ggc->chip.dev, "failed to look up irq\n");
+		return;
 	}
 
-	request = op->request;
+	local_irq_disable();
+	generic_handle_irq_desc(irq, desc);
+	local_irq_enable();
+}
+
+static void gb_gpio_event_stats_update(struct gb_gpio_controller *ggc,
+					unsigned int events, ktime_t start)
+{
+	struct gb_gpio_event_stats *stats = &ggc->stats;
+	u32 dispatch_us = (u32)ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&ggc->stats_lock);
+	stats->messages++;
+	stats->events += events;
+	stats->dispatch_us += dispatch_us;
+	stats->dispatch_max_us = max(stats->dispatch_max_us, dispatch_us);
+	spin_unlock(&ggc->stats_lock);
+}
+
+static void gb_gpio_event_delay_update(struct gb_gpio_controller *ggc,
+					u32 delay_us)
+{
+	struct gb_gpio_event_stats *stats = &ggc->stats;
+
+	spin_lock(&ggc->stats_lock);
+	if (!stats->stamped || delay_us < stats->delay_min_us)
+		stats->delay_min_us = delay_us;
+	stats->delay_max_us = max(stats->delay_max_us, delay_us);
+	stats->delay_us += delay_us;
+	stats->stamped++;
+	spin_unlock(&ggc->stats_lock);
+}
+
+static int gb_gpio_irq_event(struct gb_gpio_controller *ggc,
+				struct gb_message *request)
+{
+	struct gb_gpio_irq_event_request *event;
+	ktime_t start = ktime_get();
 
 	if (request->payload_size < sizeof(*event)) {
 		dev_err(ggc->chip.dev, "short event received (%zu < %zu)\n",
@@ -372,24 +577,93 @@ static int gb_gpio_request_recv(u8 type, struct gb_operation *op)
 		return -EINVAL;
 	}
 
-	irq = irq_find_mapping(ggc->irqdomain, event->which);
-	if (!irq) {
-		dev_err(ggc->chip.dev, "failed to find IRQ\n");
+	gb_gpio_irq_dispatch(ggc, event->which);
+	gb_gpio_event_stats_update(ggc, 1, start);
+
+	return 0;
+}
+
+static int gb_gpio_irq_event_multiple(struct gb_gpio_controller *ggc,
+					struct gb_message *request)
+{
+	struct gb_gpio_irq_event_multiple_request *event;
+	ktime_t start = ktime_get();
+	__le32 *stamp = NULL;
+	unsigned int count = 0;
+	unsigned int i;
+	size_t size;
+	u32 sent = 0;
+
+	if (request->payload_size < sizeof(*event)) {
+		dev_err(ggc->chip.dev, "short event received (%zu < %zu)\n",
+			request->payload_size, sizeof(*event));
 		return -EINVAL;
 	}
-	desc = irq_to_desc(irq);
-	if (!desc) {
-		dev_err(ggc->chip.dev, "failed to look up irq\n");
+
+	event = request->payload;
+	size = sizeof(*event) + event->size;
+	if (request->payload_size < size) {
+		dev_err(ggc->chip.dev, "short event received (%zu < %zu)\n",
+			request->payload_size, size);
 		return -EINVAL;
 	}
 
-	local_irq_disable();
-	generic_handle_irq_desc(irq, desc);
-	local_irq_enable();
+	for (i = 0; i < event->size * 8; i++) {
+		if (!gb_gpio_bitmap_test(event->data, i))
+			continue;
+		if (i > ggc->line_max) {
+			dev_err(ggc->chip.dev, "invalid hw irq: %u\n", i);
+			return -EINVAL;
+		}
+		count++;
+	}
+
+	if (event->flags & GB_GPIO_IRQ_EVENT_TIMESTAMP) {
+		size += (count + 1) * sizeof(*stamp);
+		if (request->payload_size < size) {
+			dev_err(ggc->chip.dev,
+				"short event received (%zu < %zu)\n",
+				request->payload_size, size);
+			return -EINVAL;
+		}
+		stamp = (__le32 *)(event->data + event->size);
+		sent = get_unaligned_le32(stamp++);
+	}
+
+	for (i = 0; i < event->size * 8; i++) {
+		if (!gb_gpio_bitmap_test(event->data, i))
+			continue;
+		gb_gpio_irq_dispatch(ggc, i);
+		if (stamp)
+			gb_gpio_event_delay_update(ggc,
+					sent - get_unaligned_le32(stamp++));
+	}
+	gb_gpio_event_stats_update(ggc, count, start);
 
 	return 0;
 }
 
+static int gb_gpio_request_recv(u8 type, struct gb_operation *op)
+{
+	struct gb_connection *connection = op->connection;
+	struct gb_gpio_controller *ggc = connection->private;
+
+	switch (type) {
+	case GB_GPIO_TYPE_IRQ_EVENT:
+		return gb_gpio_irq_event(ggc, op->request);
+	case GB_GPIO_TYPE_IRQ_EVENT_MULTIPLE:
+		if (!ggc->irq_event_multiple)
+			break;
+		return gb_gpio_irq_event_multiple(ggc, op->request);
+	default:
+		break;
+	}
+
+	dev_err(&connection->dev,
+		"unsupported unsolicited request: %u\n", type);
+	return -EINVAL;
+}
+
 static int gb_gpio_request(struct gpio_chip *chip, unsigned offset)
 {
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
@@ -411,6 +685,12 @@ static int gb_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
 	int ret;
 
 	which = (u8)offset;
+	if (ACCESS_ONCE(state_cache) && ggc->lines[which].direction_valid) {
+		atomic_long_inc(&ggc->cache_hits);
+		return ggc->lines[which].direction;
+	}
+	atomic_long_inc(&ggc->cache_misses);
+
 	ret = gb_gpio_get_direction_operation(ggc, which);
 	if (ret)
 		return ret;
@@ -433,18 +713,63 @@ static int gb_gpio_direction_output(struct gpio_chip *chip, unsigned offset,
 	return gb_gpio_direction_out_operation(ggc, (u8)offset, !!value);
 }
 
+/*
+ * An input's value can be cached only while the module reports every
+ * change to it, i.e. while an edge-both irq is enabled on the line.
+ */
+static bool gb_gpio_input_cacheable(struct gb_gpio_line *line)
+{
+	return ACCESS_ONCE(input_cache) &&
+		line->irq_type == GB_GPIO_IRQ_TYPE_EDGE_BOTH &&
+		!line->irq_type_pending &&
+		!line->masked && !line->masked_pending;
+}
+
+static bool gb_gpio_value_cached(struct gb_gpio_line *line)
+{
+	if (!ACCESS_ONCE(state_cache))
+		return false;
+	if (!line->direction_valid || !line->value_valid)
+		return false;
+
+	return !line->direction || gb_gpio_input_cacheable(line);
+}
+
 static int gb_gpio_get(struct gpio_chip *chip, unsigned offset)
 {
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+	struct gb_gpio_line *line;
+	unsigned int events;
 	u8 which;
 	int ret;
 
 	which = (u8)offset;
+	line = &ggc->lines[which];
+	if (gb_gpio_value_cached(line)) {
+		atomic_long_inc(&ggc->cache_hits);
+		return line->value;
+	}
+	atomic_long_inc(&ggc->cache_misses);
+
+	events = atomic_read(&line->events);
+	smp_rmb();
 	ret = gb_gpio_get_value_operation(ggc, which);
 	if (ret)
 		return ret;
 
-	return ggc->lines[which].value;
+	/*
+	 * Keep the value unless an event arrived while reading it, checking
+	 * again in case one raced with marking it valid.
+	 */
+	if (line->direction_valid &&
+			(!line->direction || gb_gpio_input_cacheable(line))) {
+		ACCESS_ONCE(line->value_valid) = true;
+		smp_mb();
+		if (events != atomic_read(&line->events))
+			ACCESS_ONCE(line->value_valid) = false;
+	}
+
+	return line->value;
 }
 
 static void gb_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
@@ -454,6 +779,116 @@ static void gb_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
 	gb_gpio_set_value_operation(ggc, (u8)offset, !!value);
 }
 
+#ifdef GPIOCHIP_HAVE_SET_MULTIPLE
+static void gb_gpio_bitmap_pack(u8 *buf, unsigned long *bits,
+				unsigned int nbits)
+{
+	unsigned int i;
+
+	memset(buf, 0, DIV_ROUND_UP(nbits, 8));
+	for_each_set_bit(i, bits, nbits)
+		buf[i / 8] |= BIT(i % 8);
+}
+
+#ifdef GPIOCHIP_HAVE_GET_MULTIPLE
+static int gb_gpio_get_multiple(struct gpio_chip *chip, unsigned long *mask,
+				unsigned long *bits)
+{
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+	struct gb_gpio_get_multiple_request *request;
+	u8 buf[sizeof(*request) + GB_GPIO_BITMAP_MAX];
+	u8 values[GB_GPIO_BITMAP_MAX];
+	unsigned int size = DIV_ROUND_UP(chip->ngpio, 8);
+	struct gb_gpio_line *line;
+	unsigned int i;
+	int ret;
+
+	for_each_set_bit(i, mask, chip->ngpio) {
+		if (!gb_gpio_value_cached(&ggc->lines[i]))
+			break;
+	}
+	if (i >= chip->ngpio) {
+		atomic_long_inc(&ggc->cache_hits);
+		for_each_set_bit(i, mask, chip->ngpio) {
+			if (ggc->lines[i].value)
+				__set_bit(i, bits);
+			else
+				__clear_bit(i, bits);
+		}
+		return 0;
+	}
+	atomic_long_inc(&ggc->cache_misses);
+
+	request = (struct gb_gpio_get_multiple_request *)buf;
+	request->size = size;
+	gb_gpio_bitmap_pack(request->mask, mask, chip->ngpio);
+	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_GET_MULTIPLE,
+				request, sizeof(*request) + size,
+				values, size);
+	if (ret) {
+		dev_err(ggc->chip.dev, "failed to get gpio values: %d\n", ret);
+		return ret;
+	}
+
+	for_each_set_bit(i, mask, chip->ngpio) {
+		line = &ggc->lines[i];
+		line->value = gb_gpio_bitmap_test(values, i);
+		if (line->direction_valid && !line->direction)
+			line->value_valid = true;
+		if (line->value)
+			__set_bit(i, bits);
+		else
+			__clear_bit(i, bits);
+	}
+
+	return 0;
+}
+#endif
+
+static void gb_gpio_set_multiple(struct gpio_chip *chip, unsigned long *mask,
+				unsigned long *bits)
+{
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+	struct gb_gpio_set_multiple_request *request;
+	u8 buf[sizeof(*request) + 2 * GB_GPIO_BITMAP_MAX];
+	unsigned int size = DIV_ROUND_UP(chip->ngpio, 8);
+	struct gb_gpio_line *line;
+	u8 *lines, *values;
+	unsigned int i;
+	int ret;
+
+	request = (struct gb_gpio_set_multiple_request *)buf;
+	request->size = size;
+	lines = request->data;
+	values = request->data + size;
+	gb_gpio_bitmap_pack(lines, mask, chip->ngpio);
+	gb_gpio_bitmap_pack(values, bits, chip->ngpio);
+
+	for_each_set_bit(i, mask, chip->ngpio) {
+		if (ggc->lines[i].direction == 1) {
+			dev_warn(ggc->chip.dev,
+				 "refusing to set value of input gpio %u\n", i);
+			lines[i / 8] &= ~BIT(i % 8);
+		}
+	}
+
+	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_SET_MULTIPLE,
+				request, sizeof(*request) + 2 * size, NULL, 0);
+	if (ret) {
+		dev_err(ggc->chip.dev, "failed to set gpio values: %d\n", ret);
+		return;
+	}
+
+	for (i = 0; i < chip->ngpio; i++) {
+		if (!gb_gpio_bitmap_test(lines, i))
+			continue;
+		line = &ggc->lines[i];
+		line->value = gb_gpio_bitmap_test(values, i);
+		line->value_valid = true;
+	}
+}
+#endif	/* GPIOCHIP_HAVE_SET_MULTIPLE */
+
 static int gb_gpio_set_debounce(struct gpio_chip *chip, unsigned offset,
 					unsigned debounce)
 {
@@ -467,6 +902,71 @@ static int gb_gpio_set_debounce(struct gpio_chip *chip, unsigned offset,
 	return gb_gpio_set_debounce_operation(ggc, (u8)offset, usec);
 }
 
+static int gb_gpio_cache_show(struct seq_file *s, void *unused)
+{
+	struct gb_gpio_controller *ggc = s->private;
+
+	seq_printf(s, "hits: %ld\n", atomic_long_read(&ggc->cache_hits));
+	seq_printf(s, "misses: %ld\n", atomic_long_read(&ggc->cache_misses));
+
+	return 0;
+}
+
+static int gb_gpio_cache_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_gpio_cache_show, inode->i_private);
+}
+
+static const struct file_operations gb_gpio_debugfs_cache_ops = {
+	.open		= gb_gpio_cache_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Dispatch times are measured on the AP, per event message.  Delays are
+ * how long the module held events before sending them, from the
+ * timestamps some modules include.
+ */
+static int gb_gpio_events_show(struct seq_file *s, void *unused)
+{
+	struct gb_gpio_controller *ggc = s->private;
+	struct gb_gpio_event_stats stats;
+
+	spin_lock(&ggc->stats_lock);
+	stats = ggc->stats;
+	spin_unlock(&ggc->stats_lock);
+
+	seq_printf(s, "messages: %lu\n", stats.messages);
+	seq_printf(s, "events: %lu\n", stats.events);
+	if (stats.messages) {
+		seq_printf(s, "dispatch_avg_us: %llu\n",
+			   div64_u64(stats.dispatch_us, stats.messages));
+		seq_printf(s, "dispatch_max_us: %u\n", stats.dispatch_max_us);
+	}
+	if (stats.stamped) {
+		seq_printf(s, "delay_min_us: %u\n", stats.delay_min_us);
+		seq_printf(s, "delay_avg_us: %llu\n",
+			   div64_u64(stats.delay_us, stats.stamped));
+		seq_printf(s, "delay_max_us: %u\n", stats.delay_max_us);
+	}
+
+	return 0;
+}
+
+static int gb_gpio_events_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_gpio_events_show, inode->i_private);
+}
+
+static const struct file_operations gb_gpio_debugfs_events_ops = {
+	.open		= gb_gpio_events_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int gb_gpio_controller_setup(struct gb_gpio_controller *ggc)
 {
 	int ret;
@@ -626,6 +1126,7 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	struct gb_gpio_controller *ggc;
 	struct gpio_chip *gpio;
 	struct irq_chip *irqc;
+	char name[32];
 	int ret;
 
 	ggc = kzalloc(sizeof(*ggc), GFP_KERNEL);
@@ -633,6 +1134,12 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 	ggc->connection = connection;
 	connection->private = ggc;
+	ggc->multiple = connection->module_minor >=
+					GB_GPIO_VERSION_MINOR_MULTIPLE;
+	ggc->irq_configure = connection->module_minor >=
+					GB_GPIO_VERSION_MINOR_IRQ_CONFIGURE;
+	ggc->irq_event_multiple = connection->module_minor >=
+					GB_GPIO_VERSION_MINOR_IRQ_EVENT_MULTIPLE;
 
 	ret = gb_gpio_controller_setup(ggc);
 	if (ret)
@@ -647,6 +1154,7 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	irqc->name = "greybus_gpio";
 
 	mutex_init(&ggc->irq_lock);
+	spin_lock_init(&ggc->stats_lock);
 
 	gpio = &ggc->chip;
 
@@ -661,6 +1169,15 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	gpio->direction_output = gb_gpio_direction_output;
 	gpio->get = gb_gpio_get;
 	gpio->set = gb_gpio_set;
+	/* Without these gpiolib falls back to one operation per line */
+#ifdef GPIOCHIP_HAVE_GET_MULTIPLE
+	if (ggc->multiple)
+		gpio->get_multiple = gb_gpio_get_multiple;
+#endif
+#ifdef GPIOCHIP_HAVE_SET_MULTIPLE
+	if (ggc->multiple)
+		gpio->set_multiple = gb_gpio_set_multiple;
+#endif
 	gpio->set_debounce = gb_gpio_set_debounce;
 	gpio->to_irq = gb_gpio_to_irq;
 	gpio->base = -1;		/* Allocate base dynamically */
@@ -681,6 +1198,17 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 		goto irqchip_err;
 	}
 
+	snprintf(name, sizeof(name), "gpio_cache_%s",
+		 dev_name(&connection->dev));
+	ggc->debugfs_file = debugfs_create_file(name, S_IFREG | S_IRUGO,
+						gb_debugfs_get(), ggc,
+						&gb_gpio_debugfs_cache_ops);
+	snprintf(name, sizeof(name), "gpio_events_%s",
+		 dev_name(&connection->dev));
+	ggc->debugfs_events = debugfs_create_file(name, S_IFREG | S_IRUGO,
+						gb_debugfs_get(), ggc,
+						&gb_gpio_debugfs_events_ops);
+
 	return 0;
 
 irqchip_err:
@@ -699,6 +1227,8 @@ static void gb_gpio_connection_exit(struct gb_connection *connection)
 	if (!ggc)
 		return;
 
+	debugfs_remove(ggc->debugfs_events);
+	debugfs_remove(ggc->debugfs_file);
 	gb_gpio_irqchip_remove(ggc);
 	gb_gpiochip_remove(&ggc->chip);
 	/* kref_put(ggc->connection) */
@@ -97,6 +97,7 @@ struct greybus_host_device {
 
 	/* Host device buffer constraints */
 	size_t buffer_size_max;
+	unsigned int sg_tablesize;	/* 0 if messages can't be gathered */
 
 	struct gb_endo *endo;
 	struct gb_connection *initial_svc_connection;
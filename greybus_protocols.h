@@ -308,13 +308,18 @@ struct gb_hid_input_report_request {
 
 /* Version of the Greybus i2c protocol we support */
 #define GB_I2C_VERSION_MAJOR		0x00
-#define GB_I2C_VERSION_MINOR		0x01
+#define GB_I2C_VERSION_MINOR		0x03
 
 /* Greybus i2c request types */
 #define GB_I2C_TYPE_FUNCTIONALITY	0x02
 #define GB_I2C_TYPE_TIMEOUT		0x03
 #define GB_I2C_TYPE_RETRIES		0x04
 #define GB_I2C_TYPE_TRANSFER		0x05
+#define GB_I2C_TYPE_SMBUS		0x06
+
+/* Modules reporting at least these minor versions support the features */
+#define GB_I2C_VERSION_MINOR_SMBUS	0x02
+#define GB_I2C_VERSION_MINOR_SPLIT	0x03
 
 #define GB_I2C_RETRIES_DEFAULT		3
 #define GB_I2C_TIMEOUT_DEFAULT		1000	/* milliseconds */
@@ -343,10 +348,20 @@ struct gb_i2c_retries_request {
  * payload consists only of bytes read, and the number of bytes is
  * exactly what was specified in the corresponding op.  Like
  * outgoing data, the incoming data is in order and contiguous.
+ *
+ * Transfers too big for one operation are split into a series of them.
+ * A message cut between ops is sent as consecutive ops, the later ones
+ * flagged I2C_M_NOSTART, and is performed as one message on the bus.
+ * The last op of every operation but the final one is flagged
+ * GB_I2C_M_CONTINUES: no stop is issued and the bus is held for the
+ * next operation.  If one of the operations fails, or the next one
+ * doesn't arrive within the transfer timeout, the module ends the
+ * transaction and fails the rest of its operations.
  */
 struct gb_i2c_transfer_op {
 	__le16	addr;
 	__le16	flags;
+#define GB_I2C_M_CONTINUES		0x0100
 	__le16	size;
 } __packed;
 
@@ -358,12 +373,48 @@ struct gb_i2c_transfer_response {
 	__u8				data[0];	/* inbound data */
 } __packed;
 
+/*
+ * A single SMBus transaction.  Outgoing data (len bytes) follows the
+ * header; for the word sizes it is little-endian.  For an i2c block
+ * read len is the number of bytes to read rather than to send.
+ *
+ * The response payload holds only the bytes read: one for the byte
+ * sizes, two for the word sizes and proc call, len for an i2c block
+ * read.  A block read response is always a count byte followed by
+ * GB_I2C_SMBUS_BLOCK_MAX data bytes, of which only count are valid.
+ */
+#define GB_I2C_SMBUS_BLOCK_MAX		32
+
+struct gb_i2c_smbus_request {
+	__le16	addr;
+	__u8	flags;
+#define GB_I2C_SMBUS_FLAG_PEC		0x01
+#define GB_I2C_SMBUS_FLAG_TEN		0x02
+	__u8	read_write;
+#define GB_I2C_SMBUS_WRITE		0x00
+#define GB_I2C_SMBUS_READ		0x01
+	__u8	command;
+	__u8	size;
+#define GB_I2C_SMBUS_QUICK		0x00
+#define GB_I2C_SMBUS_BYTE		0x01
+#define GB_I2C_SMBUS_BYTE_DATA		0x02
+#define GB_I2C_SMBUS_WORD_DATA		0x03
+#define GB_I2C_SMBUS_PROC_CALL		0x04
+#define GB_I2C_SMBUS_BLOCK_DATA		0x05
+#define GB_I2C_SMBUS_I2C_BLOCK_DATA	0x08
+	__u8	len;
+	__u8	data[0];
+} __packed;
+struct gb_i2c_smbus_response {
+	__u8	data[0];
+} __packed;
+
 
 /* GPIO */
 
 /* Version of the Greybus GPIO protocol we support */
 #define GB_GPIO_VERSION_MAJOR		0x00
-#define GB_GPIO_VERSION_MINOR		0x01
+#define GB_GPIO_VERSION_MINOR		0x04
 
 /* Greybus GPIO request types */
 #define GB_GPIO_TYPE_LINE_COUNT		0x02
@@ -379,6 +430,21 @@ struct gb_i2c_transfer_response {
 #define GB_GPIO_TYPE_IRQ_MASK		0x0c
 #define GB_GPIO_TYPE_IRQ_UNMASK		0x0d
 #define GB_GPIO_TYPE_IRQ_EVENT		0x0e
+#define GB_GPIO_TYPE_GET_MULTIPLE	0x0f
+#define GB_GPIO_TYPE_SET_MULTIPLE	0x10
+/* 0x11 is unused: it was a direction multiple request, since removed */
+#define GB_GPIO_TYPE_IRQ_CONFIGURE	0x12
+#define GB_GPIO_TYPE_IRQ_EVENT_MULTIPLE	0x13	/* Unsolicited data */
+
+/* Modules reporting at least these minor versions support the operations */
+#define GB_GPIO_VERSION_MINOR_MULTIPLE	0x02
+#define GB_GPIO_VERSION_MINOR_IRQ_CONFIGURE	0x03
+
+/*
+ * Modules may send irq event multiple requests only if both ends reported
+ * at least this minor version; older APs reject them.
+ */
+#define GB_GPIO_VERSION_MINOR_IRQ_EVENT_MULTIPLE	0x04
 
 #define GB_GPIO_IRQ_TYPE_NONE		0x00
 #define GB_GPIO_IRQ_TYPE_EDGE_RISING	0x01
@@ -461,12 +527,59 @@ struct gb_gpio_irq_event_request {
 } __packed;
 /* irq event has no response */
 
+/*
+ * The multiple line operations carry bitmaps of size bytes each, line n
+ * being bit (n % 8) of byte (n / 8).  Only lines set in the mask are
+ * affected, and the module updates them all at once.
+ */
+struct gb_gpio_get_multiple_request {
+	__u8	size;
+	__u8	mask[0];
+} __packed;
+struct gb_gpio_get_multiple_response {
+	__u8	values[0];	/* size bytes */
+} __packed;
+
+/* data is the mask followed by the values */
+struct gb_gpio_set_multiple_request {
+	__u8	size;
+	__u8	data[0];
+} __packed;
+/* set multiple response has no payload */
+
+/*
+ * data is three bitmaps: lines whose irq type changes, lines whose mask
+ * changes, and whether each of those is masked.  They are followed by
+ * one type byte (GB_GPIO_IRQ_TYPE_*) for each line whose type changes,
+ * in line order.  Type changes are applied before mask changes.
+ */
+struct gb_gpio_irq_configure_request {
+	__u8	size;
+	__u8	data[0];
+} __packed;
+/* irq configure response has no payload */
+
+/*
+ * Events for several lines, sent by the module in place of a series of
+ * irq event requests.  data is a bitmap of the lines that fired.  With
+ * GB_GPIO_IRQ_EVENT_TIMESTAMP it is followed by the module's time at
+ * sending, then the time each line fired, in line order.  Times are
+ * free-running microsecond counts, each a __le32.
+ */
+struct gb_gpio_irq_event_multiple_request {
+	__u8	size;
+	__u8	flags;
+#define GB_GPIO_IRQ_EVENT_TIMESTAMP	0x01
+	__u8	data[0];
+} __packed;
+/* irq event multiple has no response */
+
 
 /* PWM */
 
 /* Version of the Greybus PWM protocol we support */
 #define GB_PWM_VERSION_MAJOR		0x00
-#define GB_PWM_VERSION_MINOR		0x01
+#define GB_PWM_VERSION_MINOR		0x02
 
 /* Greybus PWM operation types */
 #define GB_PWM_TYPE_PWM_COUNT		0x02
@@ -476,6 +589,10 @@ struct gb_gpio_irq_event_request {
 #define GB_PWM_TYPE_POLARITY		0x06
 #define GB_PWM_TYPE_ENABLE		0x07
 #define GB_PWM_TYPE_DISABLE		0x08
+#define GB_PWM_TYPE_APPLY		0x09
+
+/* Modules reporting at least this minor version support apply */
+#define GB_PWM_VERSION_MINOR_APPLY	0x02
 
 /* pwm count request has no payload */
 struct gb_pwm_count_response {
@@ -509,6 +626,15 @@ struct gb_pwm_disable_request {
 	__u8	which;
 } __packed;
 
+/* Sets period, duty, polarity and enable together, with no partial states */
+struct gb_pwm_apply_request {
+	__u8	which;
+	__le32	duty;
+	__le32	period;
+	__u8	polarity;
+	__u8	enabled;
+} __packed;
+
 /* I2S */
 
 #define GB_I2S_MGMT_TYPE_GET_SUPPORTED_CONFIGURATIONS	0x02
@@ -651,7 +777,7 @@ struct gb_i2s_send_data_request {
 
 /* Version of the Greybus spi protocol we support */
 #define GB_SPI_VERSION_MAJOR		0x00
-#define GB_SPI_VERSION_MINOR		0x01
+#define GB_SPI_VERSION_MINOR		0x03
 
 /* Should match up with modes in linux/spi/spi.h */
 #define GB_SPI_MODE_CPHA		0x01		/* clock phase */
@@ -679,6 +805,20 @@ struct gb_i2s_send_data_request {
 #define GB_SPI_TYPE_NUM_CHIPSELECT	0x05
 #define GB_SPI_TYPE_TRANSFER		0x06
 
+/*
+ * Modules reporting at least this minor version keep the chip select
+ * asserted at the end of a transfer operation whose last transfer has
+ * cs_change set, so a message can be split across operations.
+ */
+#define GB_SPI_VERSION_MINOR_SPLIT	0x02
+
+/*
+ * Modules reporting at least this minor version accept further transfer
+ * operations while one is being executed, and execute them in order.
+ * Older modules are sent one transfer operation at a time.
+ */
+#define GB_SPI_VERSION_MINOR_WINDOW	0x03
+
 /* mode request has no payload */
 struct gb_spi_mode_response {
 	__le16	mode;
@@ -826,7 +966,7 @@ struct gb_raw_send_request {
 
 /* Version of the Greybus UART protocol we support */
 #define GB_UART_VERSION_MAJOR		0x00
-#define GB_UART_VERSION_MINOR		0x01
+#define GB_UART_VERSION_MINOR		0x02
 
 /* Greybus UART operation types */
 #define GB_UART_TYPE_SEND_DATA			0x02
@@ -835,6 +975,17 @@ struct gb_raw_send_request {
 #define GB_UART_TYPE_SET_CONTROL_LINE_STATE	0x05
 #define GB_UART_TYPE_SEND_BREAK			0x06
 #define GB_UART_TYPE_SERIAL_STATE		0x07	/* Unsolicited data */
+#define GB_UART_TYPE_FLOW_CONTROL		0x08
+#define GB_UART_TYPE_FLOW_STATUS		0x09	/* Unsolicited data */
+
+/* Modules reporting at least this minor version support flow control */
+#define GB_UART_VERSION_MINOR_FLOW_CONTROL	0x02
+
+/*
+ * Modules reporting at least this minor version accept several send data
+ * requests in flight; older ones are sent one at a time.
+ */
+#define GB_UART_VERSION_MINOR_TX_WINDOW		0x02
 
 /* Represents data from AP -> Module */
 struct gb_uart_send_data_request {
@@ -893,6 +1044,25 @@ struct gb_uart_serial_state_request {
 	__u8	control;
 } __packed;
 
+/* Tell the module to stop or resume sending received data to the AP */
+struct gb_uart_flow_control_request {
+	__u8	state;
+#define GB_UART_FLOW_RESUME			0x00
+#define GB_UART_FLOW_STOP			0x01
+} __packed;
+/* flow control response has no payload */
+
+/*
+ * Free space in the module's transmit buffer, in bytes, when the report was
+ * sent.  Data still in flight at that point is not accounted for.  Modules
+ * report again whenever space frees up; if the AP runs out of credits and
+ * hears nothing for a while, it stops limiting itself until the next report.
+ */
+struct gb_uart_flow_status_request {
+	__le16	tx_free;
+} __packed;
+/* flow status response has no payload */
+
 /* Loopback */
 
 /* Version of the Greybus loopback protocol we support */
@@ -916,7 +1086,7 @@ struct gb_loopback_transfer_response {
 /* SDIO */
 /* Version of the Greybus sdio protocol we support */
 #define GB_SDIO_VERSION_MAJOR		0x00
-#define GB_SDIO_VERSION_MINOR		0x01
+#define GB_SDIO_VERSION_MINOR		0x04
 
 /* Greybus SDIO operation types */
 #define GB_SDIO_TYPE_GET_CAPABILITIES		0x02
@@ -924,6 +1094,20 @@ struct gb_loopback_transfer_response {
 #define GB_SDIO_TYPE_COMMAND			0x04
 #define GB_SDIO_TYPE_TRANSFER			0x05
 #define GB_SDIO_TYPE_EVENT			0x06
+#define GB_SDIO_TYPE_REQUEST			0x07
+#define GB_SDIO_TYPE_TRANSFER_SIZE		0x08
+#define GB_SDIO_TYPE_TRANSFER_PART		0x09
+
+/* Modules reporting at least these minor versions support the operations */
+#define GB_SDIO_VERSION_MINOR_REQUEST		0x02
+#define GB_SDIO_VERSION_MINOR_TRANSFER_PART	0x03
+
+/*
+ * Modules reporting at least this minor version queue transfer requests,
+ * so several may be in flight for one mmc request; older ones are sent
+ * one at a time.
+ */
+#define GB_SDIO_VERSION_MINOR_TRANSFER_QUEUE	0x04
 
 /* get caps response: request has no payload */
 struct gb_sdio_get_caps_response {
@@ -1060,6 +1244,78 @@ struct gb_sdio_transfer_response {
 	__u8	data[0];
 } __packed;
 
+/*
+ * transfer size request: the largest transfer part payload the AP can send
+ * or receive.  The module answers with the size it will use, which is no
+ * larger.
+ */
+struct gb_sdio_transfer_size_request {
+	__le16	size;
+} __packed;
+
+struct gb_sdio_transfer_size_response {
+	__le16	size;
+} __packed;
+
+/*
+ * transfer part request: len bytes at offset into a transfer of data_blocks
+ * blocks of data_blksz bytes.  Parts of a transfer are sent in order and
+ * needn't hold whole blocks, so each can be filled to the negotiated size.
+ */
+struct gb_sdio_transfer_part_request {
+	__u8	data_flags;
+	__le16	data_blocks;
+	__le16	data_blksz;
+	__le32	offset;
+	__le16	len;
+	__u8	data[0];
+} __packed;
+
+struct gb_sdio_transfer_part_response {
+	__le16	len;
+	__u8	data[0];
+} __packed;
+
+/*
+ * request request: a complete mmc request, executed by the module as set
+ * block count, command, data transfer and stop, skipping absent stages.
+ * Write data follows the header.  The module stops at the first failing
+ * stage, except that stop is still issued after a data error.
+ */
+struct gb_sdio_request_request {
+	__u8	flags;
+#define GB_SDIO_REQUEST_SBC	0x01
+#define GB_SDIO_REQUEST_DATA	0x02
+#define GB_SDIO_REQUEST_STOP	0x04
+
+	__u8	data_flags;
+	__le16	data_blocks;
+	__le16	data_blksz;
+	struct gb_sdio_command_request	sbc;
+	struct gb_sdio_command_request	cmd;
+	struct gb_sdio_command_request	stop;
+	__u8	data[0];
+} __packed;
+
+/* Read data follows the header; stages not executed report success */
+struct gb_sdio_request_response {
+	__u8	sbc_status;
+	__u8	cmd_status;
+	__u8	data_status;
+	__u8	stop_status;
+#define GB_SDIO_STATUS_OK	0x00
+#define GB_SDIO_STATUS_TIMEOUT	0x01
+#define GB_SDIO_STATUS_CRC	0x02
+#define GB_SDIO_STATUS_ERROR	0x03
+
+	struct gb_sdio_command_response	sbc_resp;
+	struct gb_sdio_command_response	cmd_resp;
+	struct gb_sdio_command_response	stop_resp;
+	__le16	data_blocks;
+	__le16	data_blksz;
+	__u8	data[0];
+} __packed;
+
 /* event request: generated by module and is defined as unidirectional */
 struct gb_sdio_event_request {
 	__u8	event;
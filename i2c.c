@@ -11,6 +11,7 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/i2c.h>
+#include <asm/unaligned.h>
 
 #include "greybus.h"
 
@@ -20,10 +21,19 @@ struct gb_i2c_device {
 	u32			functionality;
 	u16			timeout_msec;
 	u8			retries;
+	bool			smbus;		/* module does smbus operations */
+	bool			split;		/* module takes split transfers */
+	size_t			payload_max;
 
 	struct i2c_adapter	adapter;
+#ifdef I2C_HAVE_ADAPTER_QUIRKS
+	struct i2c_adapter_quirks quirks;
+#endif
 };
 
+/* Operations of a split transfer kept in flight at once */
+#define GB_I2C_SPLIT_WINDOW	4
+
 /*
  * Map Greybus i2c functionality bits into Linux ones
  */
@@ -92,101 +102,148 @@ static u16 gb_i2c_transfer_op_flags_map(u16 flags)
 	return flags;	/* All flags the same for now */
 }
 
-static void
-gb_i2c_fill_transfer_op(struct gb_i2c_transfer_op *op, struct i2c_msg *msg)
+/*
+ * Position in a transfer that is sent as a series of operations.
+ */
+struct gb_i2c_split {
+	struct i2c_msg	*msgs;
+	u32		msg_count;
+	u32		msg;		/* next message to send */
+	u16		offset;		/* bytes of it already sent */
+};
+
+/*
+ * Walk as much of a transfer as fits in one operation, starting at the
+ * split position, and advance past it.  Messages that don't fit whole
+ * are cut into pieces.
+ *
+ * With no request this only sizes the operation.  Given a request
+ * whose op_count has been set, the ops and outgoing data are filled
+ * in.  Given incoming data, it is copied out to the read messages.
+ *
+ * Returns the number of ops the operation holds.
+ */
+static u16 gb_i2c_split_walk(struct gb_i2c_split *split, size_t payload_max,
+			struct gb_i2c_transfer_request *request, u8 *data_in,
+			size_t *request_size, size_t *response_size)
 {
-	u16 flags = gb_i2c_transfer_op_flags_map(msg->flags);
+	struct gb_i2c_transfer_op *op = NULL;
+	size_t req = sizeof(*request);
+	size_t resp = 0;
+	u8 *data_out = NULL;
+	u16 op_count = 0;
+
+	if (request) {
+		op = request->ops;
+		data_out = (u8 *)&request->ops[le16_to_cpu(request->op_count)];
+	}
 
-	op->addr = cpu_to_le16(msg->addr);
-	op->flags = cpu_to_le16(flags);
-	op->size = cpu_to_le16(msg->len);
+	while (split->msg < split->msg_count && op_count < U16_MAX) {
+		struct i2c_msg *msg = &split->msgs[split->msg];
+		bool read = msg->flags & I2C_M_RD;
+		size_t avail;
+		u16 flags;
+		u16 len;
+
+		if (req + sizeof(*op) > payload_max)
+			break;
+		if (read)
+			avail = payload_max - resp;
+		else
+			avail = payload_max - req - sizeof(*op);
+		len = min_t(size_t, msg->len - split->offset, avail);
+		if (!len && msg->len)
+			break;
+
+		if (op) {
+			flags = gb_i2c_transfer_op_flags_map(msg->flags);
+			if (split->offset)
+				flags |= I2C_M_NOSTART;
+			op->addr = cpu_to_le16(msg->addr);
+			op->flags = cpu_to_le16(flags);
+			op->size = cpu_to_le16(len);
+			op++;
+			if (!read) {
+				memcpy(data_out, msg->buf + split->offset, len);
+				data_out += len;
+			}
+		}
+		if (data_in && read) {
+			memcpy(msg->buf + split->offset, data_in, len);
+			data_in += len;
+		}
+
+		op_count++;
+		req += sizeof(*op);
+		if (read)
+			resp += len;
+		else
+			req += len;
+
+		split->offset += len;
+		if (split->offset == msg->len) {
+			split->msg++;
+			split->offset = 0;
+		}
+	}
+
+	/* Hold the bus if the transfer carries on in another operation */
+	if (op && split->msg < split->msg_count)
+		op[-1].flags |= cpu_to_le16(GB_I2C_M_CONTINUES);
+
+	if (request_size)
+		*request_size = req;
+	if (response_size)
+		*response_size = resp;
+
+	return op_count;
 }
 
+/*
+ * Create an operation holding as much of a transfer as fits, starting
+ * at the split position, and advance past it.
+ */
 static struct gb_operation *
-gb_i2c_operation_create(struct gb_connection *connection,
-			struct i2c_msg *msgs, u32 msg_count)
+gb_i2c_operation_create(struct gb_i2c_device *gb_i2c_dev,
+			struct gb_i2c_split *split)
 {
+	struct gb_connection *connection = gb_i2c_dev->connection;
 	struct gb_i2c_transfer_request *request;
 	struct gb_operation *operation;
-	struct gb_i2c_transfer_op *op;
-	struct i2c_msg *msg;
-	u32 data_out_size = 0;
-	u32 data_in_size = 0;
+	struct gb_i2c_split start = *split;
 	size_t request_size;
-	void *data;
+	size_t response_size;
 	u16 op_count;
-	u32 i;
 
-	if (msg_count > (u32)U16_MAX) {
-		dev_err(&connection->dev, "msg_count (%u) too big\n",
-			msg_count);
-		return NULL;
-	}
-	op_count = (u16)msg_count;
-
-	/*
-	 * In addition to space for all message descriptors we need
-	 * to have enough to hold all outbound message data.
-	 */
-	msg = msgs;
-	for (i = 0; i < msg_count; i++, msg++)
-		if (msg->flags & I2C_M_RD)
-			data_in_size += (u32)msg->len;
-		else
-			data_out_size += (u32)msg->len;
-
-	request_size = sizeof(*request);
-	request_size += msg_count * sizeof(*op);
-	request_size += data_out_size;
+	op_count = gb_i2c_split_walk(split, gb_i2c_dev->payload_max, NULL,
+					NULL, &request_size, &response_size);
 
 	/* Response consists only of incoming data */
 	operation = gb_operation_create(connection, GB_I2C_TYPE_TRANSFER,
-				request_size, data_in_size, GFP_KERNEL);
+				request_size, response_size, GFP_KERNEL);
 	if (!operation)
 		return NULL;
 
 	request = operation->request->payload;
 	request->op_count = cpu_to_le16(op_count);
-	/* Fill in the ops array */
-	op = &request->ops[0];
-	msg = msgs;
-	for (i = 0; i < msg_count; i++)
-		gb_i2c_fill_transfer_op(op++, msg++);
-
-	if (!data_out_size)
-		return operation;
-
-	/* Copy over the outgoing data; it starts after the last op */
-	data = op;
-	msg = msgs;
-	for (i = 0; i < msg_count; i++) {
-		if (!(msg->flags & I2C_M_RD)) {
-			memcpy(data, msg->buf, msg->len);
-			data += msg->len;
-		}
-		msg++;
-	}
+	gb_i2c_split_walk(&start, gb_i2c_dev->payload_max, request, NULL,
+				NULL, NULL);
 
 	return operation;
 }
 
-static void gb_i2c_decode_response(struct i2c_msg *msgs, u32 msg_count,
+/*
+ * Copy the incoming data of an operation created at the given split
+ * position out to the read messages.
+ */
+static void gb_i2c_decode_response(struct gb_i2c_device *gb_i2c_dev,
+				struct gb_i2c_split *start,
 				struct gb_i2c_transfer_response *response)
 {
-	struct i2c_msg *msg = msgs;
-	u8 *data;
-	u32 i;
-
-	if (!response)
-		return;
-	data = response->data;
-	for (i = 0; i < msg_count; i++) {
-		if (msg->flags & I2C_M_RD) {
-			memcpy(msg->buf, data, msg->len);
-			data += msg->len;
-		}
-		msg++;
-	}
+	struct gb_i2c_split split = *start;
+
+	gb_i2c_split_walk(&split, gb_i2c_dev->payload_max, NULL,
+				response->data, NULL, NULL);
 }
 
 /*
@@ -197,28 +254,87 @@ static bool gb_i2c_expected_transfer_error(int errno)
 	return errno == -EAGAIN || errno == -ENODEV;
 }
 
+static void gb_i2c_transfer_callback(struct gb_operation *operation)
+{
+	complete(&operation->completion);
+}
+
+struct gb_i2c_inflight {
+	struct gb_operation	*operation;
+	struct gb_i2c_split	start;
+};
+
+/*
+ * Send a transfer as one operation, or, if the module supports it and
+ * the transfer is too big for one, as a series of them.  Up to
+ * GB_I2C_SPLIT_WINDOW operations are kept in flight, so a large
+ * transfer isn't slowed down by a round trip per operation.
+ */
 static int gb_i2c_transfer_operation(struct gb_i2c_device *gb_i2c_dev,
 					struct i2c_msg *msgs, u32 msg_count)
 {
-	struct gb_connection *connection = gb_i2c_dev->connection;
+	struct gb_i2c_inflight inflight[GB_I2C_SPLIT_WINDOW];
+	struct gb_i2c_split split = {
+		.msgs		= msgs,
+		.msg_count	= msg_count,
+	};
+	unsigned long timeout = msecs_to_jiffies(GB_OPERATION_TIMEOUT_DEFAULT);
 	struct gb_operation *operation;
-	int ret;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	struct gb_i2c_inflight *slot;
+	int ret = 0;
+
+	while (tail != head || (!ret && split.msg < msg_count)) {
+		if (!ret && split.msg < msg_count &&
+				head - tail < GB_I2C_SPLIT_WINDOW) {
+			slot = &inflight[head % GB_I2C_SPLIT_WINDOW];
+			slot->start = split;
+			operation = gb_i2c_operation_create(gb_i2c_dev, &split);
+			if (!operation) {
+				ret = -ENOMEM;
+				continue;
+			}
+			if (!head && split.msg < msg_count &&
+					!gb_i2c_dev->split) {
+				gb_operation_destroy(operation);
+				ret = -EOPNOTSUPP;
+				continue;
+			}
+
+			ret = gb_operation_request_send(operation,
+						gb_i2c_transfer_callback,
+						GFP_KERNEL);
+			if (ret) {
+				gb_operation_destroy(operation);
+				continue;
+			}
+			slot->operation = operation;
+			head++;
+			continue;
+		}
 
-	operation = gb_i2c_operation_create(connection, msgs, msg_count);
-	if (!operation)
-		return -ENOMEM;
+		slot = &inflight[tail % GB_I2C_SPLIT_WINDOW];
+		operation = slot->operation;
+		if (!wait_for_completion_timeout(&operation->completion,
+							timeout))
+			gb_operation_cancel(operation, -ETIMEDOUT);
+
+		if (!ret) {
+			ret = gb_operation_result(operation);
+			if (!ret)
+				gb_i2c_decode_response(gb_i2c_dev, &slot->start,
+						operation->response->payload);
+		}
+		gb_operation_destroy(operation);
+		tail++;
+	}
 
-	ret = gb_operation_request_send_sync(operation);
-	if (!ret) {
-		struct gb_i2c_transfer_response *response;
+	if (!ret)
+		return msg_count;
 
-		response = operation->response->payload;
-		gb_i2c_decode_response(msgs, msg_count, response);
-		ret = msg_count;
-	} else if (!gb_i2c_expected_transfer_error(ret)) {
+	if (!gb_i2c_expected_transfer_error(ret))
 		pr_err("transfer operation failed (%d)\n", ret);
-	}
-	gb_operation_destroy(operation);
 
 	return ret;
 }
@@ -233,19 +349,179 @@ static int gb_i2c_master_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
 	return gb_i2c_transfer_operation(gb_i2c_dev, msgs, msg_count);
 }
 
-#if 0
-/* Later */
+/*
+ * Map a Linux smbus transaction size into a Greybus one, and work out
+ * how many data bytes go out with the request and come back in the
+ * response.  Sizes we don't send natively return -EOPNOTSUPP, which
+ * makes the i2c core fall back to emulating them with i2c messages.
+ */
+static int gb_i2c_smbus_size_map(int size, char read_write,
+				union i2c_smbus_data *data,
+				u8 *gb_size, u8 *out_len, u8 *in_len)
+{
+	bool read = read_write == I2C_SMBUS_READ;
+
+	*out_len = 0;
+	*in_len = 0;
+
+	switch (size) {
+	case I2C_SMBUS_QUICK:
+		*gb_size = GB_I2C_SMBUS_QUICK;
+		break;
+	case I2C_SMBUS_BYTE:
+		*gb_size = GB_I2C_SMBUS_BYTE;
+		if (read)
+			*in_len = 1;
+		break;
+	case I2C_SMBUS_BYTE_DATA:
+		*gb_size = GB_I2C_SMBUS_BYTE_DATA;
+		if (read)
+			*in_len = 1;
+		else
+			*out_len = 1;
+		break;
+	case I2C_SMBUS_WORD_DATA:
+		*gb_size = GB_I2C_SMBUS_WORD_DATA;
+		if (read)
+			*in_len = 2;
+		else
+			*out_len = 2;
+		break;
+	case I2C_SMBUS_PROC_CALL:
+		*gb_size = GB_I2C_SMBUS_PROC_CALL;
+		*out_len = 2;
+		*in_len = 2;
+		break;
+	case I2C_SMBUS_BLOCK_DATA:
+		*gb_size = GB_I2C_SMBUS_BLOCK_DATA;
+		if (read) {
+			*in_len = 1 + GB_I2C_SMBUS_BLOCK_MAX;
+			break;
+		}
+		if (!data->block[0] || data->block[0] > I2C_SMBUS_BLOCK_MAX)
+			return -EINVAL;
+		*out_len = data->block[0];
+		break;
+	case I2C_SMBUS_I2C_BLOCK_DATA:
+		*gb_size = GB_I2C_SMBUS_I2C_BLOCK_DATA;
+		if (!data->block[0] || data->block[0] > I2C_SMBUS_BLOCK_MAX)
+			return -EINVAL;
+		if (read)
+			*in_len = data->block[0];
+		else
+			*out_len = data->block[0];
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static void gb_i2c_smbus_fill_data(u8 *buf, int size,
+				union i2c_smbus_data *data)
+{
+	switch (size) {
+	case I2C_SMBUS_BYTE_DATA:
+		buf[0] = data->byte;
+		break;
+	case I2C_SMBUS_WORD_DATA:
+	case I2C_SMBUS_PROC_CALL:
+		put_unaligned_le16(data->word, buf);
+		break;
+	case I2C_SMBUS_BLOCK_DATA:
+	case I2C_SMBUS_I2C_BLOCK_DATA:
+		memcpy(buf, &data->block[1], data->block[0]);
+		break;
+	}
+}
+
+static int gb_i2c_smbus_decode_response(u8 *buf, int size,
+				union i2c_smbus_data *data)
+{
+	switch (size) {
+	case I2C_SMBUS_BYTE:
+	case I2C_SMBUS_BYTE_DATA:
+		data->byte = buf[0];
+		break;
+	case I2C_SMBUS_WORD_DATA:
+	case I2C_SMBUS_PROC_CALL:
+		data->word = get_unaligned_le16(buf);
+		break;
+	case I2C_SMBUS_BLOCK_DATA:
+		if (!buf[0] || buf[0] > I2C_SMBUS_BLOCK_MAX)
+			return -EPROTO;
+		memcpy(data->block, buf, buf[0] + 1);
+		break;
+	case I2C_SMBUS_I2C_BLOCK_DATA:
+		memcpy(&data->block[1], buf, data->block[0]);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Send an smbus transaction as a single compact operation rather than
+ * letting the i2c core emulate it with a multi-message transfer.
+ */
 static int gb_i2c_smbus_xfer(struct i2c_adapter *adap,
 			u16 addr, unsigned short flags, char read_write,
 			u8 command, int size, union i2c_smbus_data *data)
 {
-	struct gb_i2c_device *gb_i2c_dev;
+	struct gb_i2c_device *gb_i2c_dev = i2c_get_adapdata(adap);
+	struct gb_i2c_smbus_request *request;
+	struct gb_i2c_smbus_response *response;
+	struct gb_operation *operation;
+	u8 gb_size, out_len, in_len;
+	int ret;
 
-	gb_i2c_dev = i2c_get_adapdata(adap);
+	if (!gb_i2c_dev->smbus)
+		return -EOPNOTSUPP;
 
-	return 0;
+	ret = gb_i2c_smbus_size_map(size, read_write, data, &gb_size,
+					&out_len, &in_len);
+	if (ret)
+		return ret;
+
+	operation = gb_operation_create(gb_i2c_dev->connection,
+					GB_I2C_TYPE_SMBUS,
+					sizeof(*request) + out_len, in_len,
+					GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
+	request->addr = cpu_to_le16(addr);
+	request->flags = 0;
+	if (flags & I2C_CLIENT_PEC)
+		request->flags |= GB_I2C_SMBUS_FLAG_PEC;
+	if (flags & I2C_CLIENT_TEN)
+		request->flags |= GB_I2C_SMBUS_FLAG_TEN;
+	request->read_write = read_write == I2C_SMBUS_READ ?
+				GB_I2C_SMBUS_READ : GB_I2C_SMBUS_WRITE;
+	request->command = command;
+	request->size = gb_size;
+	if (size == I2C_SMBUS_I2C_BLOCK_DATA)
+		request->len = data->block[0];
+	else
+		request->len = out_len;
+	gb_i2c_smbus_fill_data(request->data, size, data);
+
+	ret = gb_operation_request_send_sync(operation);
+	if (!ret) {
+		if (in_len) {
+			response = operation->response->payload;
+			ret = gb_i2c_smbus_decode_response(response->data,
+								size, data);
+		}
+	} else if (!gb_i2c_expected_transfer_error(ret)) {
+		pr_err("smbus operation failed (%d)\n", ret);
+	}
+	gb_operation_destroy(operation);
+
+	return ret;
 }
-#endif
 
 static u32 gb_i2c_functionality(struct i2c_adapter *adap)
 {
@@ -256,7 +532,7 @@ static u32 gb_i2c_functionality(struct i2c_adapter *adap)
 
 static const struct i2c_algorithm gb_i2c_algorithm = {
 	.master_xfer	= gb_i2c_master_xfer,
-	/* .smbus_xfer	= gb_i2c_smbus_xfer, */
+	.smbus_xfer	= gb_i2c_smbus_xfer,
 	.functionality	= gb_i2c_functionality,
 };
 
@@ -298,6 +574,13 @@ static int gb_i2c_connection_init(struct gb_connection *connection)
 	gb_i2c_dev->connection = connection;	/* refcount? */
 	connection->private = gb_i2c_dev;
 
+	/* Older modules only do transfers; the i2c core emulates smbus */
+	gb_i2c_dev->smbus = connection->module_minor >=
+					GB_I2C_VERSION_MINOR_SMBUS;
+	gb_i2c_dev->split = connection->module_minor >=
+					GB_I2C_VERSION_MINOR_SPLIT;
+	gb_i2c_dev->payload_max = gb_operation_get_payload_size_max(connection);
+
 	ret = gb_i2c_device_setup(gb_i2c_dev);
 	if (ret)
 		goto out_err;
@@ -310,6 +593,18 @@ static int gb_i2c_connection_init(struct gb_connection *connection)
 	/* adapter->algo_data = what? */
 	adapter->timeout = gb_i2c_dev->timeout_msec * HZ / 1000;
 	adapter->retries = gb_i2c_dev->retries;
+#ifdef I2C_HAVE_ADAPTER_QUIRKS
+	/* Without split transfers each message has to fit one operation */
+	if (!gb_i2c_dev->split) {
+		gb_i2c_dev->quirks.max_read_len = min_t(size_t, U16_MAX,
+					gb_i2c_dev->payload_max);
+		gb_i2c_dev->quirks.max_write_len = min_t(size_t, U16_MAX,
+					gb_i2c_dev->payload_max -
+					sizeof(struct gb_i2c_transfer_request) -
+					sizeof(struct gb_i2c_transfer_op));
+		adapter->quirks = &gb_i2c_dev->quirks;
+	}
+#endif
 
 	adapter->dev.parent = &connection->dev;
 	snprintf(adapter->name, sizeof(adapter->name), "Greybus i2c adapter");
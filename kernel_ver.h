@@ -133,6 +133,38 @@ static inline void sysfs_remove_groups(struct kobject *kobj,
 	for (i = 0; groups[i]; i++)
 		sysfs_remove_group(kobj, groups[i]);
 }
+
+#include <linux/device.h>
+#include <linux/err.h>
+
+/*
+ * device_create_with_groups() also showed up in 3.11.  On older kernels the
+ * groups appear just after the uevent.
+ */
+static inline struct device *
+device_create_with_groups(struct class *class, struct device *parent,
+			  dev_t devt, void *drvdata,
+			  const struct attribute_group **groups,
+			  const char *fmt, ...)
+{
+	struct device *dev;
+	va_list vargs;
+	int error;
+
+	va_start(vargs, fmt);
+	dev = device_create_vargs(class, parent, devt, drvdata, fmt, vargs);
+	va_end(vargs);
+	if (IS_ERR(dev))
+		return dev;
+
+	error = sysfs_create_groups(&dev->kobj, groups);
+	if (error) {
+		device_unregister(dev);
+		return ERR_PTR(error);
+	}
+
+	return dev;
+}
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
@@ -246,6 +278,8 @@ static inline size_t sg_pcopy_from_buffer(struct scatterlist *sgl,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 #define list_last_entry(ptr, type, member) \
 	list_entry((ptr)->prev, type, member)
+#define list_next_entry(pos, member) \
+	list_entry((pos)->member.next, typeof(*(pos)), member)
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
@@ -289,4 +323,64 @@ static inline bool led_sysfs_is_disabled(struct led_classdev *led_cdev)
 #include <media/v4l2-flash-led-class.h>
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+/*
+ * read_iter/write_iter showed up in 3.16, and copy_{to,from}_iter() to go
+ * with them in 3.18.  Before that readv/writev on drivers without them fall
+ * back to one read/write call per segment.
+ */
+#define FILE_OPS_HAVE_ITER
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+/*
+ * usb_bus gained no_sg_constraint, set by host controllers that accept
+ * scatterlist segments of any length for bulk transfers.
+ */
+#define USB_BUS_HAS_NO_SG_CONSTRAINT
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+/* spi_master gained a hook reporting the largest transfer it takes. */
+#define SPI_HAVE_MAX_TRANSFER_SIZE
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+/* ... and one reporting the largest message. */
+#define SPI_HAVE_MAX_MESSAGE_SIZE
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+/* i2c adapters can describe transfer limits for the core to enforce. */
+#define I2C_HAVE_ADAPTER_QUIRKS
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+/* gpio_chip gained a hook for setting several lines at once. */
+#define GPIOCHIP_HAVE_SET_MULTIPLE
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+/* ... and one for getting them. */
+#define GPIOCHIP_HAVE_GET_MULTIPLE
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+/* pwm_ops gained apply(), setting the whole state of a pwm at once. */
+#define PWM_HAVE_APPLY
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+/*
+ * The is_first_req argument of the mmc pre_req host operation was dropped
+ * with the move to blk-mq.
+ */
+#define MMC_PRE_REQ_HAS_FIRST_REQ
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 6, 0)
+#define u64_to_user_ptr(x)		\
+	((void __user *)(uintptr_t)(x))
+#endif
+
 #endif	/* __GREYBUS_KERNEL_VER_H */
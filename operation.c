@@ -13,6 +13,7 @@
 #include <linux/sched.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/scatterlist.h>
 
 #include "greybus.h"
 
@@ -196,8 +197,21 @@ gb_operation_find_outgoing(struct gb_connection *connection, u16 operation_id)
 static int gb_message_send(struct gb_message *message, gfp_t gfp)
 {
 	struct gb_connection *connection = message->operation->connection;
+	struct greybus_host_device *hd = connection->hd;
 
-	return connection->hd->driver->message_send(connection->hd,
+	/*
+	 * If the host device can't gather the scatterlist itself, copy the
+	 * data in behind the payload; there's room for it in the buffer.
+	 */
+	if (message->sg && message->sg_nents >= hd->sg_tablesize) {
+		sg_copy_to_buffer(message->sg, message->sg_nents,
+				  (u8 *)(message->header + 1) +
+					message->payload_size,
+				  message->sg_size);
+		message->sg = NULL;
+	}
+
+	return hd->driver->message_send(hd,
 					connection->hd_cport_id,
 					message,
 					gfp);
@@ -222,7 +236,9 @@ static void gb_operation_request_handle(struct gb_operation *operation)
 	if (!protocol)
 		return;
 
-	if (protocol->request_recv) {
+	if (operation->flags & GB_OPERATION_FLAG_HANDLED) {
+		status = 0;
+	} else if (protocol->request_recv) {
 		status = protocol->request_recv(operation->type, operation);
 	} else {
 		dev_err(&operation->connection->dev,
@@ -269,7 +285,7 @@ static void gb_operation_work(struct work_struct *work)
 
 static void gb_operation_message_init(struct greybus_host_device *hd,
 				struct gb_message *message, u16 operation_id,
-				size_t payload_size, u8 type)
+				size_t payload_size, size_t sg_size, u8 type)
 {
 	struct gb_operation_msg_hdr *header;
 
@@ -278,6 +294,7 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
 	message->header = header;
 	message->payload = payload_size ? header + 1 : NULL;
 	message->payload_size = payload_size;
+	message->sg_size = sg_size;
 
 	/*
 	 * The type supplied for incoming message buffers will be
@@ -285,7 +302,7 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
 	 * so there's no need to initialize the message header.
 	 */
 	if (type != GB_OPERATION_TYPE_INVALID) {
-		u16 message_size = (u16)(sizeof(*header) + payload_size);
+		u16 message_size = (u16)gb_message_size(message);
 
 		/*
 		 * For a request, the operation id gets filled in
@@ -316,21 +333,30 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
  * Our message buffers have the following layout:
  *	message header  \_ these combined are
  *	message payload /  the message size
+ *
+ * Messages may also carry sg_size bytes of scatterlist data following
+ * the payload.  Request buffers leave room for it in case the host
+ * device can't send the scatterlist directly; response data is copied
+ * straight to the scatterlist, so response buffers don't need it.
  */
 static struct gb_message *
 gb_operation_message_alloc(struct greybus_host_device *hd, u8 type,
-				size_t payload_size, gfp_t gfp_flags)
+				size_t payload_size, size_t sg_size,
+				gfp_t gfp_flags)
 {
 	struct gb_message *message;
 	struct gb_operation_msg_hdr *header;
 	size_t message_size = payload_size + sizeof(*header);
 
-	if (message_size > hd->buffer_size_max) {
+	if (message_size + sg_size > hd->buffer_size_max) {
 		pr_warn("requested message size too big (%zu > %zu)\n",
-				message_size, hd->buffer_size_max);
+				message_size + sg_size, hd->buffer_size_max);
 		return NULL;
 	}
 
+	if (!(type & GB_MESSAGE_TYPE_RESPONSE))
+		message_size += sg_size;
+
 	/* Allocate the message structure and buffer. */
 	message = kmem_cache_zalloc(gb_message_cache, gfp_flags);
 	if (!message)
@@ -341,7 +367,7 @@ gb_operation_message_alloc(struct greybus_host_device *hd, u8 type,
 		goto err_free_message;
 
 	/* Initialize the message.  Operation id is filled in later. */
-	gb_operation_message_init(hd, message, 0, payload_size, type);
+	gb_operation_message_init(hd, message, 0, payload_size, sg_size, type);
 
 	return message;
 
@@ -425,8 +451,9 @@ static u8 gb_operation_errno_map(int errno)
 	}
 }
 
-bool gb_operation_response_alloc(struct gb_operation *operation,
-					size_t response_size, gfp_t gfp)
+static bool _gb_operation_response_alloc(struct gb_operation *operation,
+					size_t response_size, size_t sg_size,
+					gfp_t gfp)
 {
 	struct greybus_host_device *hd = operation->connection->hd;
 	struct gb_operation_msg_hdr *request_header;
@@ -434,7 +461,8 @@ bool gb_operation_response_alloc(struct gb_operation *operation,
 	u8 type;
 
 	type = operation->type | GB_MESSAGE_TYPE_RESPONSE;
-	response = gb_operation_message_alloc(hd, type, response_size, gfp);
+	response = gb_operation_message_alloc(hd, type, response_size, sg_size,
+					      gfp);
 	if (!response)
 		return false;
 	response->operation = operation;
@@ -451,6 +479,12 @@ bool gb_operation_response_alloc(struct gb_operation *operation,
 
 	return true;
 }
+
+bool gb_operation_response_alloc(struct gb_operation *operation,
+					size_t response_size, gfp_t gfp)
+{
+	return _gb_operation_response_alloc(operation, response_size, 0, gfp);
+}
 EXPORT_SYMBOL_GPL(gb_operation_response_alloc);
 
 /*
@@ -477,7 +511,8 @@ EXPORT_SYMBOL_GPL(gb_operation_response_alloc);
  */
 static struct gb_operation *
 gb_operation_create_common(struct gb_connection *connection, u8 type,
-				size_t request_size, size_t response_size,
+				size_t request_size, size_t request_sg_size,
+				size_t response_size, size_t response_sg_size,
 				unsigned long op_flags, gfp_t gfp_flags)
 {
 	struct greybus_host_device *hd = connection->hd;
@@ -489,6 +524,7 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 	operation->connection = connection;
 
 	operation->request = gb_operation_message_alloc(hd, type, request_size,
+							request_sg_size,
 							gfp_flags);
 	if (!operation->request)
 		goto err_cache;
@@ -496,8 +532,8 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 
 	/* Allocate the response buffer for outgoing operations */
 	if (!(op_flags & GB_OPERATION_FLAG_INCOMING)) {
-		if (!gb_operation_response_alloc(operation, response_size,
-						 gfp_flags)) {
+		if (!_gb_operation_response_alloc(operation, response_size,
+						  response_sg_size, gfp_flags)) {
 			goto err_request;
 		}
 	}
@@ -540,10 +576,35 @@ struct gb_operation *gb_operation_create(struct gb_connection *connection,
 		type &= ~GB_MESSAGE_TYPE_RESPONSE;
 
 	return gb_operation_create_common(connection, type,
-					request_size, response_size, 0, gfp);
+					request_size, 0, response_size, 0,
+					0, gfp);
 }
 EXPORT_SYMBOL_GPL(gb_operation_create);
 
+/*
+ * Create an operation whose request and/or response carry data in a
+ * scatterlist in addition to their payload.  The scatterlists are
+ * attached with gb_message_set_sg() before the request is sent.
+ */
+struct gb_operation *gb_operation_create_sg(struct gb_connection *connection,
+					u8 type, size_t request_size,
+					size_t request_sg_size,
+					size_t response_size,
+					size_t response_sg_size,
+					gfp_t gfp)
+{
+	if (WARN_ON_ONCE(type == GB_OPERATION_TYPE_INVALID))
+		return NULL;
+	if (WARN_ON_ONCE(type & GB_MESSAGE_TYPE_RESPONSE))
+		type &= ~GB_MESSAGE_TYPE_RESPONSE;
+
+	return gb_operation_create_common(connection, type,
+					request_size, request_sg_size,
+					response_size, response_sg_size,
+					0, gfp);
+}
+EXPORT_SYMBOL_GPL(gb_operation_create_sg);
+
 size_t gb_operation_get_payload_size_max(struct gb_connection *connection)
 {
 	struct greybus_host_device *hd = connection->hd;
@@ -567,7 +628,8 @@ gb_operation_create_incoming(struct gb_connection *connection, u16 id,
 		flags |= GB_OPERATION_FLAG_UNIDIRECTIONAL;
 
 	operation = gb_operation_create_common(connection, type,
-					request_size, 0, flags, GFP_ATOMIC);
+					request_size, 0, 0, 0, flags,
+					GFP_ATOMIC);
 	if (!operation)
 		return NULL;
 
@@ -640,6 +702,12 @@ int gb_operation_request_send(struct gb_operation *operation,
 
 	if (!callback)
 		return -EINVAL;
+	if (WARN_ON_ONCE(operation->request->sg_size &&
+			 !operation->request->sg))
+		return -EINVAL;
+	if (WARN_ON_ONCE(operation->response->sg_size &&
+			 !operation->response->sg))
+		return -EINVAL;
 	/*
 	 * Record the callback function, which is executed in
 	 * non-atomic (workqueue) context when the final result
@@ -808,6 +876,26 @@ void greybus_message_sent(struct greybus_host_device *hd,
 }
 EXPORT_SYMBOL_GPL(greybus_message_sent);
 
+/*
+ * Give the protocol a chance to handle an incoming request straight from
+ * the receive (interrupt) context.  If it does, the request handler is not
+ * called again, and only the response is left for the workqueue.
+ */
+static bool gb_operation_request_handle_atomic(struct gb_operation *operation)
+{
+	struct gb_protocol *protocol = operation->connection->protocol;
+
+	if (!protocol || !protocol->request_recv_atomic)
+		return false;
+
+	if (!protocol->request_recv_atomic(operation->type, operation))
+		return false;
+
+	operation->flags |= GB_OPERATION_FLAG_HANDLED;
+
+	return true;
+}
+
 /*
  * We've received data on a connection, and it doesn't look like a
  * response, so we assume it's a request.
@@ -835,6 +923,14 @@ static void gb_connection_recv_request(struct gb_connection *connection,
 		return;
 	}
 
+	/* Nothing left to do for handled requests that need no response */
+	if (gb_operation_request_handle_atomic(operation) &&
+			gb_operation_is_unidirectional(operation)) {
+		gb_operation_put_active(operation);
+		gb_operation_put(operation);
+		return;
+	}
+
 	/*
 	 * The initial reference to the operation will be dropped when the
 	 * request handler returns.
@@ -858,6 +954,7 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 	struct gb_message *message;
 	int errno = gb_operation_status_map(result);
 	size_t message_size;
+	size_t linear_size;
 
 	operation = gb_operation_find_outgoing(connection, operation_id);
 	if (!operation) {
@@ -866,7 +963,7 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 	}
 
 	message = operation->response;
-	message_size = sizeof(*message->header) + message->payload_size;
+	message_size = gb_message_size(message);
 	if (!errno && size != message_size) {
 		dev_err(&connection->dev, "bad message (0x%02hhx) size (%zu != %zu)\n",
 			message->header->type, size, message_size);
@@ -879,7 +976,12 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 
 	/* The rest will be handled in work queue context */
 	if (gb_operation_result_set(operation, errno)) {
-		memcpy(message->header, data, size);
+		linear_size = min(size, message_size - message->sg_size);
+		memcpy(message->header, data, linear_size);
+		if (size > linear_size)
+			sg_copy_from_buffer(message->sg, message->sg_nents,
+					    data + linear_size,
+					    size - linear_size);
 		queue_work(gb_operation_completion_wq, &operation->work);
 	}
 
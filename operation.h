@@ -13,6 +13,7 @@
 #include <linux/completion.h>
 
 struct gb_operation;
+struct scatterlist;
 
 /* The default amount of time a request is given to complete */
 #define GB_OPERATION_TIMEOUT_DEFAULT	1000	/* milliseconds */
@@ -50,6 +51,12 @@ enum gb_operation_result {
  * Protocol code should only examine the payload and payload_size fields, and
  * host-controller drivers may use the hcpriv field. All other fields are
  * intended to be private to the operations core code.
+ *
+ * A message may also carry sg_size bytes of payload data beyond payload_size,
+ * described by a scatterlist supplied with gb_message_set_sg().  For outbound
+ * messages the host driver gathers sg itself if it's still set when the
+ * message is sent; otherwise the data has been copied into the buffer.
+ * Inbound data is copied straight into the scatterlist.
  */
 struct gb_message {
 	struct gb_operation		*operation;
@@ -58,13 +65,50 @@ struct gb_message {
 	void				*payload;
 	size_t				payload_size;
 
+	struct scatterlist		*sg;
+	unsigned int			sg_nents;
+	size_t				sg_size;
+
 	void				*buffer;
 
 	void				*hcpriv;
 };
 
+/* The number of bytes a message occupies on the wire */
+static inline size_t gb_message_size(struct gb_message *message)
+{
+	return sizeof(*message->header) + message->payload_size +
+		message->sg_size;
+}
+
+/*
+ * The scatterlist must describe exactly sg_size bytes, and must remain valid
+ * until the operation has completed.
+ */
+static inline void gb_message_set_sg(struct gb_message *message,
+				struct scatterlist *sg, unsigned int nents)
+{
+	message->sg = sg;
+	message->sg_nents = nents;
+}
+
+/*
+ * Shrink the payload of an outbound message before it is sent, when less
+ * data turned out to be available than it was allocated for.
+ */
+static inline void gb_message_trim_payload(struct gb_message *message,
+					   size_t payload_size)
+{
+	if (WARN_ON_ONCE(payload_size > message->payload_size))
+		return;
+
+	message->payload_size = payload_size;
+	message->header->size = cpu_to_le16(gb_message_size(message));
+}
+
 #define GB_OPERATION_FLAG_INCOMING		BIT(0)
 #define GB_OPERATION_FLAG_UNIDIRECTIONAL	BIT(1)
+#define GB_OPERATION_FLAG_HANDLED		BIT(2)
 
 /*
  * A Greybus operation is a remote procedure call performed over a
@@ -80,6 +124,8 @@ struct gb_message {
  * pointer; the operation type; the request message payload (and
  * size); and the response message payload (and size).  Note that a
  * message with a 0-byte payload has a null message payload pointer.
+ * Protocol code may also attach its own data to an operation, using
+ * gb_operation_set_data() and gb_operation_get_data().
  *
  * In addition, every operation has a result, which is an errno
  * value.  Protocol handlers access the operation result using
@@ -105,6 +151,8 @@ struct gb_operation {
 
 	int			active;
 	struct list_head	links;		/* connection->operations */
+
+	void			*private;
 };
 
 static inline bool
@@ -119,6 +167,17 @@ gb_operation_is_unidirectional(struct gb_operation *operation)
 	return operation->flags & GB_OPERATION_FLAG_UNIDIRECTIONAL;
 }
 
+static inline void
+gb_operation_set_data(struct gb_operation *operation, void *data)
+{
+	operation->private = data;
+}
+
+static inline void *gb_operation_get_data(struct gb_operation *operation)
+{
+	return operation->private;
+}
+
 void gb_connection_recv(struct gb_connection *connection,
 					void *data, size_t size);
 
@@ -129,6 +188,12 @@ struct gb_operation *gb_operation_create(struct gb_connection *connection,
 					u8 type, size_t request_size,
 					size_t response_size,
 					gfp_t gfp);
+struct gb_operation *gb_operation_create_sg(struct gb_connection *connection,
+					u8 type, size_t request_size,
+					size_t request_sg_size,
+					size_t response_size,
+					size_t response_sg_size,
+					gfp_t gfp);
 void gb_operation_get(struct gb_operation *operation);
 void gb_operation_put(struct gb_operation *operation);
 static inline void gb_operation_destroy(struct gb_operation *operation)
@@ -41,6 +41,37 @@ static struct gb_protocol *gb_protocol_find(u8 id, u8 major, u8 minor)
 	return NULL;
 }
 
+/*
+ * Like gb_protocol_find(), but a newer minor version will do: minor
+ * versions are backwards compatible, and the features they add are
+ * negotiated per connection.  The newest one registered is returned.
+ *
+ * Caller must hold gb_protocols_lock.
+ */
+static struct gb_protocol *gb_protocol_find_compatible(u8 id, u8 major,
+						       u8 minor)
+{
+	struct gb_protocol *protocol;
+
+	list_for_each_entry(protocol, &gb_protocols, links) {
+		if (protocol->id < id)
+			continue;
+		if (protocol->id > id)
+			break;
+
+		if (protocol->major > major)
+			continue;
+		if (protocol->major < major)
+			break;
+
+		if (protocol->minor < minor)
+			break;
+
+		return protocol;
+	}
+	return NULL;
+}
+
 int __gb_protocol_register(struct gb_protocol *protocol, struct module *module)
 {
 	struct gb_protocol *existing;
@@ -135,14 +166,17 @@ int gb_protocol_deregister(struct gb_protocol *protocol)
 }
 EXPORT_SYMBOL_GPL(gb_protocol_deregister);
 
-/* Returns the requested protocol if available, or a null pointer */
+/*
+ * Returns the requested protocol, or a newer minor version of it, if
+ * available, or a null pointer
+ */
 struct gb_protocol *gb_protocol_get(u8 id, u8 major, u8 minor)
 {
 	struct gb_protocol *protocol;
 	u8 protocol_count;
 
 	spin_lock_irq(&gb_protocols_lock);
-	protocol = gb_protocol_find(id, major, minor);
+	protocol = gb_protocol_find_compatible(id, major, minor);
 	if (protocol) {
 		if (!try_module_get(protocol->owner)) {
 			protocol = NULL;
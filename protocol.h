@@ -16,6 +16,7 @@ struct gb_operation;
 typedef int (*gb_connection_init_t)(struct gb_connection *);
 typedef void (*gb_connection_exit_t)(struct gb_connection *);
 typedef int (*gb_request_recv_t)(u8, struct gb_operation *);
+typedef bool (*gb_request_recv_atomic_t)(u8, struct gb_operation *);
 
 /*
  * Protocols having the same id but different major and/or minor
@@ -33,6 +34,7 @@ struct gb_protocol {
 	gb_connection_init_t	connection_init;
 	gb_connection_exit_t	connection_exit;
 	gb_request_recv_t	request_recv;
+	gb_request_recv_atomic_t request_recv_atomic;	/* optional */
 	struct module		*owner;
 	char			*name;
 };
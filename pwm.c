@@ -17,6 +17,7 @@
 struct gb_pwm_chip {
 	struct gb_connection	*connection;
 	u8			pwm_max;	/* max pwm number */
+	bool			apply;		/* module does apply operations */
 
 	struct pwm_chip		chip;
 	struct pwm_chip		*pwm;
@@ -120,6 +121,26 @@ static int gb_pwm_disable_operation(struct gb_pwm_chip *pwmc,
 				 &request, sizeof(request), NULL, 0);
 }
 
+#ifdef PWM_HAVE_APPLY
+static int gb_pwm_apply_operation(struct gb_pwm_chip *pwmc, u8 which,
+				  u32 duty, u32 period, u8 polarity,
+				  bool enabled)
+{
+	struct gb_pwm_apply_request request;
+
+	if (which > pwmc->pwm_max)
+		return -EINVAL;
+
+	request.which = which;
+	request.duty = cpu_to_le32(duty);
+	request.period = cpu_to_le32(period);
+	request.polarity = polarity;
+	request.enabled = enabled;
+	return gb_operation_sync(pwmc->connection, GB_PWM_TYPE_APPLY,
+				 &request, sizeof(request), NULL, 0);
+}
+#endif
+
 static int gb_pwm_request(struct pwm_chip *chip, struct pwm_device *pwm)
 {
 	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
@@ -167,6 +188,69 @@ static void gb_pwm_disable(struct pwm_chip *chip, struct pwm_device *pwm)
 	gb_pwm_disable_operation(pwmc, pwm->hwpwm);
 };
 
+#ifdef PWM_HAVE_APPLY
+/*
+ * Older modules get the state changed one operation at a time, in the
+ * order the pwm core uses for drivers without apply().
+ */
+static int gb_pwm_apply_sequence(struct gb_pwm_chip *pwmc,
+				 struct pwm_device *pwm,
+				 struct pwm_state *state)
+{
+	struct pwm_state cur;
+	int ret;
+
+	pwm_get_state(pwm, &cur);
+
+	if (state->polarity != cur.polarity) {
+		if (cur.enabled) {
+			ret = gb_pwm_disable_operation(pwmc, pwm->hwpwm);
+			if (ret)
+				return ret;
+			cur.enabled = false;
+		}
+
+		ret = gb_pwm_set_polarity_operation(pwmc, pwm->hwpwm,
+						    state->polarity);
+		if (ret)
+			return ret;
+	}
+
+	/*
+	 * The core records the new period and duty cycle even for a
+	 * disabled pwm, so they must reach the module now.
+	 */
+	if (state->period != cur.period ||
+	    state->duty_cycle != cur.duty_cycle) {
+		ret = gb_pwm_config_operation(pwmc, pwm->hwpwm,
+					      state->duty_cycle, state->period);
+		if (ret)
+			return ret;
+	}
+
+	if (state->enabled == cur.enabled)
+		return 0;
+
+	if (state->enabled)
+		return gb_pwm_enable_operation(pwmc, pwm->hwpwm);
+
+	return gb_pwm_disable_operation(pwmc, pwm->hwpwm);
+}
+
+static int gb_pwm_apply(struct pwm_chip *chip, struct pwm_device *pwm,
+			struct pwm_state *state)
+{
+	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
+
+	if (!pwmc->apply)
+		return gb_pwm_apply_sequence(pwmc, pwm, state);
+
+	return gb_pwm_apply_operation(pwmc, pwm->hwpwm, state->duty_cycle,
+				      state->period, state->polarity,
+				      state->enabled);
+}
+#endif
+
 static const struct pwm_ops gb_pwm_ops = {
 	.request = gb_pwm_request,
 	.free = gb_pwm_free,
@@ -174,6 +258,9 @@ static const struct pwm_ops gb_pwm_ops = {
 	.set_polarity = gb_pwm_set_polarity,
 	.enable = gb_pwm_enable,
 	.disable = gb_pwm_disable,
+#ifdef PWM_HAVE_APPLY
+	.apply = gb_pwm_apply,
+#endif
 	.owner = THIS_MODULE,
 };
 
@@ -188,6 +275,7 @@ static int gb_pwm_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 	pwmc->connection = connection;
 	connection->private = pwmc;
+	pwmc->apply = connection->module_minor >= GB_PWM_VERSION_MINOR_APPLY;
 
 	/* Query number of pwms present */
 	ret = gb_pwm_count_operation(pwmc);
@@ -11,29 +11,83 @@
 #include <linux/slab.h>
 #include <linux/sizes.h>
 #include <linux/cdev.h>
+#include <linux/compat.h>
 #include <linux/fs.h>
 #include <linux/idr.h>
+#include <linux/kfifo.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 
 #include "greybus.h"
+#include "raw.h"
+
+/*
+ * Kernel view of one of the rings shared with userspace.  Everything but the
+ * descriptors and data is a private copy, as userspace may scribble over the
+ * shared control block at any time.  index is the ring index the kernel owns:
+ * head for the rx ring, tail for the tx ring.
+ */
+struct gb_raw_mring {
+	struct gb_raw_ring *ctrl;
+	struct gb_raw_ring_desc *desc;
+	void *data;
+	u32 slots;
+	u32 index;
+};
 
 struct gb_raw {
 	struct gb_connection *connection;
 
-	struct list_head list;
-	int list_data;
-	struct mutex list_lock;
+	/*
+	 * Received packets are stored as length-prefixed records in a
+	 * preallocated ring.  The connection workqueue is the only producer
+	 * and readers are serialised by read_lock, so the ring itself needs
+	 * no locking.
+	 */
+	struct kfifo_rec_ptr_2 rx_fifo;
+	struct mutex read_lock;
+	void *rx_bounce;
+	wait_queue_head_t rx_wq;
+	unsigned long rx_packets;
+	unsigned long rx_bytes;
+	unsigned long rx_dropped;
+
+	/*
+	 * Up to tx_window send operations may be in flight at once.  The
+	 * first failure of an asynchronous send is latched in tx_error and
+	 * reported by the next write(), fsync() or poll().
+	 */
+	spinlock_t tx_lock;
+	wait_queue_head_t tx_wq;
+	unsigned int tx_window;
+	unsigned int tx_inflight;
+	int tx_error;
+	unsigned long tx_packets;
+	unsigned long tx_bytes;
+	unsigned long tx_errors;
+
+	/*
+	 * Optional rings shared with userspace through mmap().  Once set up,
+	 * received packets go to ring_rx instead of rx_fifo.  The rings
+	 * belong to the file that set them up and go away when it is
+	 * released.  ring_lock serialises setup, teardown and consumption
+	 * of ring_tx.
+	 */
+	struct mutex ring_lock;
+	struct file *ring_owner;
+	void *ring_area;
+	size_t ring_size;
+	struct gb_raw_mring ring_rx;
+	struct gb_raw_mring ring_tx;
+
 	dev_t dev;
 	struct cdev cdev;
 	struct device *device;
 };
 
-struct raw_data {
-	struct list_head entry;
-	u32 len;
-	u8 data[0];
-};
-
 static struct class *raw_class;
 static int raw_major;
 static const struct file_operations raw_fops;
@@ -45,47 +99,130 @@ static DEFINE_IDA(minors);
 /* Maximum size of any one send data buffer we support */
 #define MAX_PACKET_SIZE	(PAGE_SIZE * 2)
 
+/* Receive ring records store their length in 16 bits */
+#define MAX_RX_PACKET_SIZE	min_t(size_t, MAX_PACKET_SIZE, 0xffff)
+
 /*
- * Maximum size of the data in the receive buffer we allow before we start to
- * drop messages on the floor
+ * Default size of the receive ring, including the per-packet record headers.
+ * Once it is full we start to drop messages on the floor.  The ring size is
+ * rounded up to a power of two when it is allocated.
  */
-#define MAX_DATA_SIZE	(MAX_PACKET_SIZE * 8)
+#define RX_BUFFER_SIZE_DEFAULT	(MAX_PACKET_SIZE * 8)
+
+static unsigned int rx_buffer_size = RX_BUFFER_SIZE_DEFAULT;
+module_param(rx_buffer_size, uint, 0444);
+MODULE_PARM_DESC(rx_buffer_size, "size in bytes of each device's receive ring");
+
+/* Number of send operations a device may have in flight */
+#define TX_WINDOW_DEFAULT	4
+#define TX_WINDOW_MAX		64
+
+static unsigned int tx_window = TX_WINDOW_DEFAULT;
+module_param(tx_window, uint, 0444);
+MODULE_PARM_DESC(tx_window, "initial number of in-flight sends per device");
 
 /*
- * Add the raw data message to the list of received messages.
+ * Asynchronous sends have no timeout of their own, so a send the module
+ * doesn't answer in time is cancelled from raw_timeout_wq.  Otherwise a
+ * lost response would hold its transmit window slot for good.
  */
-static int receive_data(struct gb_raw *raw, u32 len, u8 *data)
+#define TX_TIMEOUT_MS		GB_OPERATION_TIMEOUT_DEFAULT
+
+struct gb_raw_send_timeout {
+	struct delayed_work work;
+	struct gb_operation *operation;
+};
+
+static struct workqueue_struct *raw_timeout_wq;
+
+/* Shared ring geometry: every slot can hold a maximum sized packet */
+#define RING_SLOT_SIZE		MAX_PACKET_SIZE
+#define RING_SLOTS_MAX		256
+
+static void *gb_raw_mring_slot(struct gb_raw_mring *ring, u32 index)
 {
-	struct raw_data *raw_data;
-	int retval = 0;
+	return ring->data + (index & (ring->slots - 1)) * RING_SLOT_SIZE;
+}
+
+static struct gb_raw_ring_desc *gb_raw_mring_desc(struct gb_raw_mring *ring,
+						  u32 index)
+{
+	return &ring->desc[index & (ring->slots - 1)];
+}
+
+static bool gb_raw_ring_enabled(struct gb_raw *raw)
+{
+	if (!ACCESS_ONCE(raw->ring_area))
+		return false;
+
+	/* Pairs with smp_wmb() in gb_raw_ring_setup() */
+	smp_rmb();
+
+	return true;
+}
+
+/*
+ * Place a received message in the next free slot of the shared rx ring.
+ */
+static int gb_raw_ring_receive(struct gb_raw *raw, u32 len, u8 *data)
+{
+	struct gb_raw_mring *ring = &raw->ring_rx;
+	u32 tail;
+
+	tail = ACCESS_ONCE(ring->ctrl->tail);
+	if (ring->index - tail >= ring->slots) {
+		dev_err_ratelimited(raw->device,
+			"Receive ring full, now dropping packets\n");
+		raw->rx_dropped++;
+		return -EINVAL;
+	}
+
+	/* Don't overwrite the slot before userspace has released it */
+	smp_mb();
+
+	memcpy(gb_raw_mring_slot(ring, ring->index), data, len);
+	gb_raw_mring_desc(ring, ring->index)->len = len;
 
-	if (len > MAX_PACKET_SIZE) {
+	/* Publish the slot contents before the new head */
+	smp_wmb();
+	ring->index++;
+	ACCESS_ONCE(ring->ctrl->head) = ring->index;
+
+	raw->rx_packets++;
+	raw->rx_bytes += len;
+
+	wake_up_interruptible(&raw->rx_wq);
+
+	return 0;
+}
+
+/*
+ * Add the raw data message to the receive ring.
+ */
+static int receive_data(struct gb_raw *raw, u32 len, u8 *data)
+{
+	if (len > MAX_RX_PACKET_SIZE) {
 		dev_err(raw->device, "Too big of a data packet, rejected\n");
+		raw->rx_dropped++;
 		return -EINVAL;
 	}
 
-	mutex_lock(&raw->list_lock);
-	if ((raw->list_data + len) > MAX_DATA_SIZE) {
-		dev_err(raw->device,
+	if (gb_raw_ring_enabled(raw))
+		return gb_raw_ring_receive(raw, len, data);
+
+	if (!kfifo_in(&raw->rx_fifo, data, len)) {
+		dev_err_ratelimited(raw->device,
 			"Too much data in receive buffer, now dropping packets\n");
-		retval = -EINVAL;
-		goto exit;
+		raw->rx_dropped++;
+		return -EINVAL;
 	}
 
-	raw_data = kmalloc(sizeof(*raw_data) + len, GFP_KERNEL);
-	if (!raw_data) {
-		retval = -ENOMEM;
-		goto exit;
-	}
+	raw->rx_packets++;
+	raw->rx_bytes += len;
 
-	raw->list_data += len;
-	raw_data->len = len;
-	memcpy(&raw_data->data[0], data, len);
+	wake_up_interruptible(&raw->rx_wq);
 
-	list_add_tail(&raw_data->entry, &raw->list);
-exit:
-	mutex_unlock(&raw->list_lock);
-	return retval;
+	return 0;
 }
 
 static int gb_raw_receive(u8 type, struct gb_operation *op)
@@ -123,31 +260,468 @@ static int gb_raw_receive(u8 type, struct gb_operation *op)
 	return receive_data(raw, len, receive->data);
 }
 
-static int gb_raw_send(struct gb_raw *raw, u32 len, const char __user *data)
+static bool gb_raw_tx_ready(struct gb_raw *raw)
+{
+	return raw->tx_inflight < raw->tx_window;
+}
+
+static bool gb_raw_tx_idle(struct gb_raw *raw)
+{
+	return !raw->tx_inflight;
+}
+
+/*
+ * Claim a slot in the transmit window, waiting for one to free up unless
+ * nonblock is set.
+ */
+static int gb_raw_tx_get(struct gb_raw *raw, bool nonblock)
+{
+	int retval;
+
+	spin_lock_irq(&raw->tx_lock);
+	while (!gb_raw_tx_ready(raw)) {
+		spin_unlock_irq(&raw->tx_lock);
+
+		if (nonblock)
+			return -EAGAIN;
+
+		retval = wait_event_interruptible(raw->tx_wq,
+						  gb_raw_tx_ready(raw));
+		if (retval)
+			return retval;
+
+		spin_lock_irq(&raw->tx_lock);
+	}
+	raw->tx_inflight++;
+	spin_unlock_irq(&raw->tx_lock);
+
+	return 0;
+}
+
+static void gb_raw_tx_put(struct gb_raw *raw)
+{
+	spin_lock_irq(&raw->tx_lock);
+	raw->tx_inflight--;
+	spin_unlock_irq(&raw->tx_lock);
+
+	wake_up_interruptible(&raw->tx_wq);
+}
+
+/* Return and clear the error of an earlier asynchronous send, if any. */
+static int gb_raw_tx_error(struct gb_raw *raw)
+{
+	int retval;
+
+	spin_lock_irq(&raw->tx_lock);
+	retval = raw->tx_error;
+	raw->tx_error = 0;
+	spin_unlock_irq(&raw->tx_lock);
+
+	return retval;
+}
+
+/*
+ * Holds a reference to the operation until it either completes or is
+ * cancelled.  gb_operation_cancel() waits for the callback, so this always
+ * runs to the end after it.
+ */
+static void gb_raw_send_timeout_work(struct work_struct *work)
+{
+	struct gb_raw_send_timeout *timeout;
+
+	timeout = container_of(work, struct gb_raw_send_timeout, work.work);
+
+	gb_operation_cancel(timeout->operation, -ETIMEDOUT);
+	gb_operation_put(timeout->operation);
+	kfree(timeout);
+}
+
+static void gb_raw_send_callback(struct gb_operation *operation)
+{
+	struct gb_raw *raw = operation->connection->private;
+	struct gb_raw_send_request *request = operation->request->payload;
+	struct gb_raw_send_timeout *timeout = gb_operation_get_data(operation);
+	int retval;
+
+	retval = gb_operation_result(operation);
+
+	spin_lock_irq(&raw->tx_lock);
+	if (retval) {
+		if (!raw->tx_error)
+			raw->tx_error = retval;
+		raw->tx_errors++;
+	} else {
+		raw->tx_packets++;
+		raw->tx_bytes += le32_to_cpu(request->len);
+	}
+	spin_unlock_irq(&raw->tx_lock);
+
+	if (retval) {
+		dev_err_ratelimited(raw->device, "send operation failed: %d\n",
+				    retval);
+	}
+
+	gb_raw_tx_put(raw);
+
+	/* Otherwise the timeout is running and cleans up after itself */
+	if (cancel_delayed_work(&timeout->work)) {
+		gb_operation_put(operation);
+		kfree(timeout);
+	}
+
+	gb_operation_put(operation);
+}
+
+/* Create a send operation with room for len bytes of data. */
+static struct gb_operation *gb_raw_send_create(struct gb_raw *raw, u32 len)
+{
+	struct gb_raw_send_timeout *timeout;
+	struct gb_raw_send_request *request;
+	struct gb_operation *operation;
+
+	timeout = kmalloc(sizeof(*timeout), GFP_KERNEL);
+	if (!timeout)
+		return NULL;
+
+	operation = gb_operation_create(raw->connection, GB_RAW_TYPE_SEND,
+					len + sizeof(*request), 0,
+					GFP_KERNEL);
+	if (!operation) {
+		kfree(timeout);
+		return NULL;
+	}
+
+	INIT_DELAYED_WORK(&timeout->work, gb_raw_send_timeout_work);
+	timeout->operation = operation;
+	gb_operation_set_data(operation, timeout);
+
+	request = operation->request->payload;
+	request->len = cpu_to_le32(len);
+
+	return operation;
+}
+
+/* Destroy a send operation that was never sent. */
+static void gb_raw_send_destroy(struct gb_operation *operation)
+{
+	kfree(gb_operation_get_data(operation));
+	gb_operation_destroy(operation);
+}
+
+/*
+ * Send an operation without waiting for the module to acknowledge it.  The
+ * caller must hold a transmit window slot, which is released when the
+ * operation completes or if sending fails.  The operation is cancelled if
+ * it hasn't completed within TX_TIMEOUT_MS.
+ */
+static int gb_raw_send_submit(struct gb_raw *raw,
+			      struct gb_operation *operation)
+{
+	struct gb_raw_send_timeout *timeout = gb_operation_get_data(operation);
+	int retval;
+
+	/* The timeout's reference; the callback may drop ours at any time */
+	gb_operation_get(operation);
+
+	retval = gb_operation_request_send(operation, gb_raw_send_callback,
+					   GFP_KERNEL);
+	if (retval) {
+		gb_operation_put(operation);
+		gb_raw_send_destroy(operation);
+		gb_raw_tx_put(raw);
+		return retval;
+	}
+
+	queue_delayed_work(raw_timeout_wq, &timeout->work,
+			   msecs_to_jiffies(TX_TIMEOUT_MS));
+
+	return 0;
+}
+
+/*
+ * Queue a send operation without waiting for the module to acknowledge it.
+ * The user data is copied straight into the operation's request message.
+ */
+static int gb_raw_send(struct gb_raw *raw, u32 len, const char __user *data,
+		       bool nonblock)
 {
-	struct gb_connection *connection = raw->connection;
 	struct gb_raw_send_request *request;
+	struct gb_operation *operation;
 	int retval;
 
-	request = kmalloc(len + sizeof(*request), GFP_KERNEL);
-	if (!request)
+	retval = gb_raw_tx_get(raw, nonblock);
+	if (retval)
+		return retval;
+
+	operation = gb_raw_send_create(raw, len);
+	if (!operation) {
+		gb_raw_tx_put(raw);
 		return -ENOMEM;
+	}
 
+	request = operation->request->payload;
 	if (copy_from_user(&request->data[0], data, len)) {
-		kfree(request);
+		gb_raw_send_destroy(operation);
+		gb_raw_tx_put(raw);
 		return -EFAULT;
 	}
 
-	request->len = cpu_to_le32(len);
+	return gb_raw_send_submit(raw, operation);
+}
 
-	retval = gb_operation_sync(connection, GB_RAW_TYPE_SEND,
-				   request, len + sizeof(*request),
-				   NULL, 0);
+static int gb_raw_ring_setup(struct gb_raw *raw, struct file *file,
+			     struct gb_raw_ring_setup __user *arg)
+{
+	struct gb_raw_ring_setup setup;
+	struct gb_raw_ring_header *header;
+	size_t rx_desc, tx_desc, rx_data, tx_data;
+	size_t size;
+	void *area;
+	int retval = 0;
 
-	kfree(request);
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+
+	if (!is_power_of_2(setup.rx_slots) || setup.rx_slots > RING_SLOTS_MAX ||
+	    !is_power_of_2(setup.tx_slots) || setup.tx_slots > RING_SLOTS_MAX)
+		return -EINVAL;
+
+	rx_desc = sizeof(*header);
+	tx_desc = rx_desc + setup.rx_slots * sizeof(struct gb_raw_ring_desc);
+	rx_data = PAGE_ALIGN(tx_desc +
+			     setup.tx_slots * sizeof(struct gb_raw_ring_desc));
+	tx_data = rx_data + setup.rx_slots * RING_SLOT_SIZE;
+	size = PAGE_ALIGN(tx_data + setup.tx_slots * RING_SLOT_SIZE);
+
+	mutex_lock(&raw->ring_lock);
+	if (raw->ring_area) {
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	area = vmalloc_user(size);
+	if (!area) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	header = area;
+	header->rx.slots = setup.rx_slots;
+	header->rx.desc_offset = rx_desc;
+	header->rx.data_offset = rx_data;
+	header->tx.slots = setup.tx_slots;
+	header->tx.desc_offset = tx_desc;
+	header->tx.data_offset = tx_data;
+
+	raw->ring_rx.ctrl = &header->rx;
+	raw->ring_rx.desc = area + rx_desc;
+	raw->ring_rx.data = area + rx_data;
+	raw->ring_rx.slots = setup.rx_slots;
+	raw->ring_rx.index = 0;
+
+	raw->ring_tx.ctrl = &header->tx;
+	raw->ring_tx.desc = area + tx_desc;
+	raw->ring_tx.data = area + tx_data;
+	raw->ring_tx.slots = setup.tx_slots;
+	raw->ring_tx.index = 0;
+
+	raw->ring_size = size;
+	raw->ring_owner = file;
+
+	/* Pairs with smp_rmb() in gb_raw_ring_enabled() */
+	smp_wmb();
+	ACCESS_ONCE(raw->ring_area) = area;
+
+	/*
+	 * The ring stays set up even if this fails, and is torn down when
+	 * the file is released.
+	 */
+	setup.slot_size = RING_SLOT_SIZE;
+	setup.mmap_size = size;
+	if (copy_to_user(arg, &setup, sizeof(setup)))
+		retval = -EFAULT;
+
+exit:
+	mutex_unlock(&raw->ring_lock);
 	return retval;
 }
 
+/*
+ * Queue every packet userspace has added to the shared tx ring since the
+ * last kick.  Returns the number of packets queued, or an error if the first
+ * one could not be.  Slots are only handed back once their packet is queued.
+ *
+ * ring_lock is dropped while waiting for room in the transmit window, so
+ * that a slow module doesn't hold up ring setup and teardown.
+ */
+static int gb_raw_ring_kick(struct gb_raw *raw, bool nonblock)
+{
+	struct gb_raw_mring *ring = &raw->ring_tx;
+	struct gb_raw_send_request *request;
+	struct gb_operation *operation;
+	int count = 0;
+	int retval;
+	u32 head;
+	u32 len;
+
+again:
+	retval = 0;
+	mutex_lock(&raw->ring_lock);
+	if (!raw->ring_area) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	head = ACCESS_ONCE(ring->ctrl->head);
+	if (head - ring->index > ring->slots) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	/* Read the slot contents only after the head that published them */
+	smp_rmb();
+
+	while (ring->index != head) {
+		len = ACCESS_ONCE(gb_raw_mring_desc(ring, ring->index)->len);
+		if (!len || len > RING_SLOT_SIZE) {
+			retval = -EINVAL;
+			break;
+		}
+
+		retval = gb_raw_tx_error(raw);
+		if (retval)
+			break;
+
+		retval = gb_raw_tx_get(raw, true);
+		if (retval == -EAGAIN && !nonblock) {
+			mutex_unlock(&raw->ring_lock);
+
+			retval = wait_event_interruptible(raw->tx_wq,
+							  gb_raw_tx_ready(raw));
+			if (retval)
+				return count ? count : retval;
+
+			goto again;
+		}
+		if (retval)
+			break;
+
+		operation = gb_raw_send_create(raw, len);
+		if (!operation) {
+			gb_raw_tx_put(raw);
+			retval = -ENOMEM;
+			break;
+		}
+
+		/*
+		 * The slot is copied rather than sent from in place: it goes
+		 * back to userspace as soon as the packet is queued.
+		 */
+		request = operation->request->payload;
+		memcpy(&request->data[0], gb_raw_mring_slot(ring, ring->index),
+		       len);
+
+		/* A slot that could not be sent stays queued for the next kick */
+		retval = gb_raw_send_submit(raw, operation);
+		if (retval)
+			break;
+
+		/* Finish with the slot before handing it back to userspace */
+		smp_mb();
+		ring->index++;
+		ACCESS_ONCE(ring->ctrl->tail) = ring->index;
+
+		count++;
+	}
+
+exit:
+	mutex_unlock(&raw->ring_lock);
+	return count ? count : retval;
+}
+
+/* Tear down the shared rings if file set them up. */
+static void gb_raw_ring_release(struct gb_raw *raw, struct file *file)
+{
+	void *area;
+
+	mutex_lock(&raw->ring_lock);
+	if (raw->ring_owner != file) {
+		mutex_unlock(&raw->ring_lock);
+		return;
+	}
+	area = raw->ring_area;
+	ACCESS_ONCE(raw->ring_area) = NULL;
+	raw->ring_owner = NULL;
+	mutex_unlock(&raw->ring_lock);
+
+	/* Let a receive handler still filling ring_rx finish with it */
+	flush_workqueue(raw->connection->wq);
+
+	vfree(area);
+}
+
+#define gb_raw_counter_attr(field)					\
+static ssize_t field##_show(struct device *dev,				\
+			    struct device_attribute *attr,		\
+			    char *buf)					\
+{									\
+	struct gb_raw *raw = dev_get_drvdata(dev);			\
+	return sprintf(buf, "%lu\n", raw->field);			\
+}									\
+static DEVICE_ATTR_RO(field)
+
+gb_raw_counter_attr(rx_packets);
+gb_raw_counter_attr(rx_bytes);
+gb_raw_counter_attr(rx_dropped);
+gb_raw_counter_attr(tx_packets);
+gb_raw_counter_attr(tx_bytes);
+gb_raw_counter_attr(tx_errors);
+
+static ssize_t tx_window_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct gb_raw *raw = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", raw->tx_window);
+}
+
+static ssize_t tx_window_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct gb_raw *raw = dev_get_drvdata(dev);
+	unsigned int val;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &val);
+	if (retval)
+		return retval;
+
+	if (!val || val > TX_WINDOW_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&raw->tx_lock);
+	raw->tx_window = val;
+	spin_unlock_irq(&raw->tx_lock);
+
+	wake_up_interruptible(&raw->tx_wq);
+
+	return len;
+}
+static DEVICE_ATTR_RW(tx_window);
+
+static struct attribute *raw_attrs[] = {
+	&dev_attr_rx_packets.attr,
+	&dev_attr_rx_bytes.attr,
+	&dev_attr_rx_dropped.attr,
+	&dev_attr_tx_packets.attr,
+	&dev_attr_tx_bytes.attr,
+	&dev_attr_tx_errors.attr,
+	&dev_attr_tx_window.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(raw);
+
 static int gb_raw_connection_init(struct gb_connection *connection)
 {
 	struct gb_raw *raw;
@@ -161,13 +735,24 @@ static int gb_raw_connection_init(struct gb_connection *connection)
 	raw->connection = connection;
 	connection->private = raw;
 
-	INIT_LIST_HEAD(&raw->list);
-	mutex_init(&raw->list_lock);
+	mutex_init(&raw->read_lock);
+	init_waitqueue_head(&raw->rx_wq);
+	spin_lock_init(&raw->tx_lock);
+	mutex_init(&raw->ring_lock);
+	init_waitqueue_head(&raw->tx_wq);
+	raw->tx_window = clamp_t(unsigned int, tx_window, 1, TX_WINDOW_MAX);
+
+	retval = kfifo_alloc(&raw->rx_fifo,
+			     max_t(unsigned int, rx_buffer_size,
+				   MAX_RX_PACKET_SIZE + sizeof(u16)),
+			     GFP_KERNEL);
+	if (retval)
+		goto error_free;
 
 	minor = ida_simple_get(&minors, 0, 0, GFP_KERNEL);
 	if (minor < 0) {
 		retval = minor;
-		goto error_free;
+		goto error_kfifo;
 	}
 
 	raw->dev = MKDEV(raw_major, minor);
@@ -176,8 +761,9 @@ static int gb_raw_connection_init(struct gb_connection *connection)
 	if (retval)
 		goto error_cdev;
 
-	raw->device = device_create(raw_class, &connection->dev, raw->dev, raw,
-				    "gb!raw%d", minor);
+	raw->device = device_create_with_groups(raw_class, &connection->dev,
+						raw->dev, raw, raw_groups,
+						"gb!raw%d", minor);
 	if (IS_ERR(raw->device)) {
 		retval = PTR_ERR(raw->device);
 		goto error_device;
@@ -191,6 +777,9 @@ error_device:
 error_cdev:
 	ida_simple_remove(&minors, minor);
 
+error_kfifo:
+	kfifo_free(&raw->rx_fifo);
+
 error_free:
 	kfree(raw);
 	return retval;
@@ -199,19 +788,14 @@ error_free:
 static void gb_raw_connection_exit(struct gb_connection *connection)
 {
 	struct gb_raw *raw = connection->private;
-	struct raw_data *raw_data;
-	struct raw_data *temp;
 
 	// FIXME - handle removing a connection when the char device node is open.
 	cdev_del(&raw->cdev);
 	ida_simple_remove(&minors, MINOR(raw->dev));
 	device_del(raw->device);
-	mutex_lock(&raw->list_lock);
-	list_for_each_entry_safe(raw_data, temp, &raw->list, entry) {
-		list_del(&raw_data->entry);
-		kfree(raw_data);
-	}
-	mutex_unlock(&raw->list_lock);
+	kfifo_free(&raw->rx_fifo);
+	kfree(raw->rx_bounce);
+	vfree(raw->ring_area);
 
 	kfree(raw);
 }
@@ -233,6 +817,24 @@ static struct gb_protocol raw_protocol = {
  * This means for read(), you have to provide a big enough buffer for the full
  * message to be copied into.  If the buffer isn't big enough, the read() will
  * fail with -ENOSPC.
+ *
+ * read() blocks until a message is available unless the file was opened with
+ * O_NONBLOCK, in which case it fails with -EAGAIN.  poll() reports when a
+ * message can be read.
+ *
+ * write() queues the message and returns without waiting for the module to
+ * acknowledge it, blocking (or failing with -EAGAIN) only when the transmit
+ * window is full.  A failed send is reported by the next write(), fsync() or
+ * poll() (as POLLERR), and fsync() waits for all queued messages to complete.
+ * A message the module doesn't acknowledge within TX_TIMEOUT_MS fails with
+ * -ETIMEDOUT.
+ *
+ * Alternatively, GB_RAW_IOC_RING_SETUP sets up rx and tx rings that userspace
+ * maps with mmap(), see raw.h.  Messages then move without a system call or
+ * user copy per packet, and read() is no longer available.
+ *
+ * GB_RAW_IOC_SEND_BATCH and GB_RAW_IOC_RECV_BATCH move many messages in one
+ * call, one message per struct gb_raw_packet.
  */
 
 static int raw_open(struct inode *inode, struct file *file)
@@ -244,6 +846,15 @@ static int raw_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static int raw_release(struct inode *inode, struct file *file)
+{
+	struct gb_raw *raw = file->private_data;
+
+	gb_raw_ring_release(raw, file);
+
+	return 0;
+}
+
 static ssize_t raw_write(struct file *file, const char __user *buf,
 			 size_t count, loff_t *ppos)
 {
@@ -256,50 +867,388 @@ static ssize_t raw_write(struct file *file, const char __user *buf,
 	if (count > MAX_PACKET_SIZE)
 		return -E2BIG;
 
-	retval = gb_raw_send(raw, count, buf);
+	retval = gb_raw_tx_error(raw);
+	if (retval)
+		return retval;
+
+	retval = gb_raw_send(raw, count, buf, file->f_flags & O_NONBLOCK);
 	if (retval)
 		return retval;
 
 	return count;
 }
 
+static int raw_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct gb_raw *raw = file->private_data;
+	int retval;
+
+	retval = wait_event_interruptible(raw->tx_wq, gb_raw_tx_idle(raw));
+	if (retval)
+		return retval;
+
+	return gb_raw_tx_error(raw);
+}
+
+/*
+ * Wait for a message to arrive in the receive ring.  On success read_lock is
+ * held and the ring is not empty.
+ */
+static int gb_raw_rx_wait(struct gb_raw *raw, bool nonblock)
+{
+	int retval;
+
+	if (mutex_lock_interruptible(&raw->read_lock))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&raw->rx_fifo)) {
+		mutex_unlock(&raw->read_lock);
+
+		if (nonblock)
+			return -EAGAIN;
+
+		retval = wait_event_interruptible(raw->rx_wq,
+					!kfifo_is_empty(&raw->rx_fifo));
+		if (retval)
+			return retval;
+
+		if (mutex_lock_interruptible(&raw->read_lock))
+			return -ERESTARTSYS;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the next message to userspace.  The caller holds read_lock and has
+ * made sure the receive ring is not empty.
+ */
+static int gb_raw_rx_copy(struct gb_raw *raw, char __user *buf, size_t count)
+{
+	unsigned int copied;
+	unsigned int len;
+	int retval;
+
+	len = kfifo_peek_len(&raw->rx_fifo);
+	if (len > count)
+		return -ENOSPC;
+
+	retval = kfifo_to_user(&raw->rx_fifo, buf, len, &copied);
+	if (retval)
+		return retval;
+
+	return copied;
+}
+
 static ssize_t raw_read(struct file *file, char __user *buf, size_t count,
 			loff_t *ppos)
 {
 	struct gb_raw *raw = file->private_data;
-	int retval = 0;
-	struct raw_data *raw_data;
+	int retval;
 
-	mutex_lock(&raw->list_lock);
-	if (list_empty(&raw->list))
-		goto exit;
+	if (gb_raw_ring_enabled(raw))
+		return -EBUSY;
+
+	retval = gb_raw_rx_wait(raw, file->f_flags & O_NONBLOCK);
+	if (retval)
+		return retval;
+
+	retval = gb_raw_rx_copy(raw, buf, count);
 
-	raw_data = list_first_entry(&raw->list, struct raw_data, entry);
-	if (raw_data->len > count) {
+	mutex_unlock(&raw->read_lock);
+	return retval;
+}
+
+#ifdef FILE_OPS_HAVE_ITER
+/*
+ * readv() and writev() transfer a single message scattered over, or gathered
+ * from, all the segments, like recvmsg() and sendmsg() on a datagram socket.
+ */
+static ssize_t raw_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct gb_raw *raw = file->private_data;
+	struct gb_raw_send_request *request;
+	struct gb_operation *operation;
+	size_t count = iov_iter_count(from);
+	int retval;
+
+	if (!count)
+		return 0;
+
+	if (count > MAX_PACKET_SIZE)
+		return -E2BIG;
+
+	retval = gb_raw_tx_error(raw);
+	if (retval)
+		return retval;
+
+	retval = gb_raw_tx_get(raw, file->f_flags & O_NONBLOCK);
+	if (retval)
+		return retval;
+
+	operation = gb_raw_send_create(raw, count);
+	if (!operation) {
+		gb_raw_tx_put(raw);
+		return -ENOMEM;
+	}
+
+	request = operation->request->payload;
+	if (copy_from_iter(&request->data[0], count, from) != count) {
+		gb_raw_send_destroy(operation);
+		gb_raw_tx_put(raw);
+		return -EFAULT;
+	}
+
+	retval = gb_raw_send_submit(raw, operation);
+	if (retval)
+		return retval;
+
+	return count;
+}
+
+static ssize_t raw_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct gb_raw *raw = file->private_data;
+	unsigned int len;
+	int retval;
+
+	if (gb_raw_ring_enabled(raw))
+		return -EBUSY;
+
+	retval = gb_raw_rx_wait(raw, file->f_flags & O_NONBLOCK);
+	if (retval)
+		return retval;
+
+	len = kfifo_peek_len(&raw->rx_fifo);
+	if (len > iov_iter_count(to)) {
 		retval = -ENOSPC;
 		goto exit;
 	}
 
-	if (copy_to_user(buf, &raw_data->data[0], raw_data->len)) {
-		retval = -EFAULT;
-		goto exit;
+	/*
+	 * Messages may wrap around the end of the ring, so gather them into
+	 * a linear buffer first.
+	 */
+	if (!raw->rx_bounce) {
+		raw->rx_bounce = kmalloc(MAX_PACKET_SIZE, GFP_KERNEL);
+		if (!raw->rx_bounce) {
+			retval = -ENOMEM;
+			goto exit;
+		}
 	}
 
-	list_del(&raw_data->entry);
-	raw->list_data -= raw_data->len;
-	retval = raw_data->len;
-	kfree(raw_data);
+	/* Leave the message in the ring if it can't be copied out */
+	len = kfifo_out_peek(&raw->rx_fifo, raw->rx_bounce, MAX_PACKET_SIZE);
+	if (copy_to_iter(raw->rx_bounce, len, to) != len) {
+		retval = -EFAULT;
+	} else {
+		kfifo_skip(&raw->rx_fifo);
+		retval = len;
+	}
 
 exit:
-	mutex_unlock(&raw->list_lock);
+	mutex_unlock(&raw->read_lock);
+	return retval;
+}
+#endif
+
+/*
+ * Queue every packet of a batch, stopping at the first failure.  Returns the
+ * number of packets queued if there were any, otherwise the error.
+ */
+static int gb_raw_send_batch(struct gb_raw *raw,
+			     struct gb_raw_batch __user *arg, bool nonblock)
+{
+	struct gb_raw_packet __user *packets;
+	struct gb_raw_packet packet;
+	struct gb_raw_batch batch;
+	int retval;
+	u32 done;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	retval = gb_raw_tx_error(raw);
+	if (retval)
+		return retval;
+
+	packets = u64_to_user_ptr(batch.packets);
+	for (done = 0; done < batch.count; done++) {
+		if (copy_from_user(&packet, &packets[done], sizeof(packet))) {
+			retval = -EFAULT;
+			break;
+		}
+
+		if (!packet.len || packet.len > MAX_PACKET_SIZE) {
+			retval = -EINVAL;
+			break;
+		}
+
+		retval = gb_raw_send(raw, packet.len,
+				     u64_to_user_ptr(packet.data), nonblock);
+		if (retval)
+			break;
+	}
+
+	if (put_user(done, &arg->done))
+		return -EFAULT;
+
+	return done ? done : retval;
+}
+
+/*
+ * Drain up to a batch worth of messages, one per packet buffer.  Only the
+ * first message is waited for.  The length of each message is written back
+ * to its packet entry.
+ */
+static int gb_raw_recv_batch(struct gb_raw *raw,
+			     struct gb_raw_batch __user *arg, bool nonblock)
+{
+	struct gb_raw_packet __user *packets;
+	struct gb_raw_packet packet;
+	struct gb_raw_batch batch;
+	int retval;
+	u32 done;
+
+	if (gb_raw_ring_enabled(raw))
+		return -EBUSY;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count)
+		return 0;
+
+	retval = gb_raw_rx_wait(raw, nonblock);
+	if (retval)
+		return retval;
+
+	packets = u64_to_user_ptr(batch.packets);
+	for (done = 0; done < batch.count; done++) {
+		if (kfifo_is_empty(&raw->rx_fifo))
+			break;
+
+		if (copy_from_user(&packet, &packets[done], sizeof(packet))) {
+			retval = -EFAULT;
+			break;
+		}
+
+		retval = gb_raw_rx_copy(raw, u64_to_user_ptr(packet.data),
+					packet.len);
+		if (retval < 0)
+			break;
+
+		if (put_user(retval, &packets[done].len)) {
+			retval = -EFAULT;
+			break;
+		}
+	}
+
+	mutex_unlock(&raw->read_lock);
+
+	if (put_user(done, &arg->done))
+		return -EFAULT;
+
+	return done ? done : retval;
+}
+
+static long raw_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct gb_raw *raw = file->private_data;
+
+	switch (cmd) {
+	case GB_RAW_IOC_RING_SETUP:
+		return gb_raw_ring_setup(raw, file, (void __user *)arg);
+	case GB_RAW_IOC_TX_KICK:
+		return gb_raw_ring_kick(raw, file->f_flags & O_NONBLOCK);
+	case GB_RAW_IOC_SEND_BATCH:
+		return gb_raw_send_batch(raw, (void __user *)arg,
+					 file->f_flags & O_NONBLOCK);
+	case GB_RAW_IOC_RECV_BATCH:
+		return gb_raw_recv_batch(raw, (void __user *)arg,
+					 file->f_flags & O_NONBLOCK);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static long raw_compat_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	return raw_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static int raw_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct gb_raw *raw = file->private_data;
+	int retval;
+
+	/* Only the owner maps the rings, so they outlive every mapping */
+	mutex_lock(&raw->ring_lock);
+	if (!raw->ring_area || raw->ring_owner != file)
+		retval = -EINVAL;
+	else
+		retval = remap_vmalloc_range(vma, raw->ring_area,
+					     vma->vm_pgoff);
+	mutex_unlock(&raw->ring_lock);
+
 	return retval;
 }
 
+static bool gb_raw_rx_pending(struct gb_raw *raw, struct file *file)
+{
+	if (gb_raw_ring_enabled(raw)) {
+		/* Other files may not look at rings that can go at any time */
+		if (ACCESS_ONCE(raw->ring_owner) != file)
+			return false;
+
+		return raw->ring_rx.index != ACCESS_ONCE(raw->ring_rx.ctrl->tail);
+	}
+
+	return !kfifo_is_empty(&raw->rx_fifo);
+}
+
+static unsigned int raw_poll(struct file *file, poll_table *wait)
+{
+	struct gb_raw *raw = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &raw->rx_wq, wait);
+	poll_wait(file, &raw->tx_wq, wait);
+
+	if (gb_raw_rx_pending(raw, file))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (gb_raw_tx_ready(raw))
+		mask |= POLLOUT | POLLWRNORM;
+
+	if (raw->tx_error)
+		mask |= POLLERR;
+
+	return mask;
+}
+
 static const struct file_operations raw_fops = {
 	.owner		= THIS_MODULE,
 	.write		= raw_write,
 	.read		= raw_read,
+#ifdef FILE_OPS_HAVE_ITER
+	.write_iter	= raw_write_iter,
+	.read_iter	= raw_read_iter,
+#endif
+	.poll		= raw_poll,
+	.fsync		= raw_fsync,
+	.unlocked_ioctl	= raw_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= raw_compat_ioctl,
+#endif
+	.mmap		= raw_mmap,
 	.open		= raw_open,
+	.release	= raw_release,
 	.llseek		= noop_llseek,
 };
 
@@ -308,6 +1257,10 @@ static int raw_init(void)
 	dev_t dev;
 	int retval;
 
+	raw_timeout_wq = alloc_workqueue("gb_raw_timeout", 0, 0);
+	if (!raw_timeout_wq)
+		return -ENOMEM;
+
 	raw_class = class_create(THIS_MODULE, "gb_raw");
 	if (IS_ERR(raw_class)) {
 		retval = PTR_ERR(raw_class);
@@ -332,6 +1285,7 @@ error_gb:
 error_chrdev:
 	class_destroy(raw_class);
 error_class:
+	destroy_workqueue(raw_timeout_wq);
 	return retval;
 }
 module_init(raw_init);
@@ -342,6 +1296,7 @@ static void __exit raw_exit(void)
 	unregister_chrdev_region(MKDEV(raw_major, 0), NUM_MINORS);
 	class_destroy(raw_class);
 	ida_destroy(&minors);
+	destroy_workqueue(raw_timeout_wq);
 }
 module_exit(raw_exit);
 
@@ -0,0 +1,110 @@
+/*
+ * Greybus Raw protocol character device interface
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ *
+ * This header is shared with userspace, so it must only use exported types.
+ */
+
+#ifndef __GB_RAW_H
+#define __GB_RAW_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Shared memory rings
+ *
+ * After a successful GB_RAW_IOC_RING_SETUP, mmap() of the device (offset 0,
+ * length mmap_size) exposes the following layout:
+ *
+ *	struct gb_raw_ring_header	rx and tx ring control blocks
+ *	struct gb_raw_ring_desc[]	rx descriptors, at rx.desc_offset
+ *	struct gb_raw_ring_desc[]	tx descriptors, at tx.desc_offset
+ *	rx slots			rx.slots * slot_size bytes, at rx.data_offset
+ *	tx slots			tx.slots * slot_size bytes, at tx.data_offset
+ *
+ * Each ring is single-producer/single-consumer.  head is only written by
+ * the producer and tail only by the consumer; both are free-running and
+ * the slot index is (index & (slots - 1)).  For the rx ring the kernel is
+ * the producer, for the tx ring userspace is.
+ *
+ * Slot n's data lives at data_offset + n * slot_size, and its descriptor
+ * holds the packet length.  A producer fills the slot and descriptor before
+ * advancing head; a consumer is done with the slot when it advances tail.
+ *
+ * The rings belong to the file that set them up: only it can mmap() them,
+ * and they are freed when it is closed.  Until then a second
+ * GB_RAW_IOC_RING_SETUP fails with -EBUSY.
+ *
+ * poll() reports POLLIN while the rx ring is non-empty.  New tx entries are
+ * handed to the kernel with GB_RAW_IOC_TX_KICK, which returns the number of
+ * packets queued for transmission.  tail only moves past packets that were
+ * queued; if the first one can't be, the kick fails with the error.
+ */
+struct gb_raw_ring {
+	__u32	head;
+	__u32	tail;
+	__u32	slots;
+	__u32	desc_offset;
+	__u32	data_offset;
+	__u32	pad[11];	/* keep head/tail of each ring on own line */
+};
+
+struct gb_raw_ring_header {
+	struct gb_raw_ring	rx;
+	struct gb_raw_ring	tx;
+};
+
+struct gb_raw_ring_desc {
+	__u32	len;
+	__u32	reserved;
+};
+
+struct gb_raw_ring_setup {
+	__u32	rx_slots;	/* in: power of two */
+	__u32	tx_slots;	/* in: power of two */
+	__u32	slot_size;	/* out */
+	__u32	mmap_size;	/* out */
+};
+
+/*
+ * Batched I/O
+ *
+ * GB_RAW_IOC_SEND_BATCH sends count messages, message n being the len bytes
+ * at packets[n].data.  The messages are pipelined through the transmit
+ * window.
+ *
+ * GB_RAW_IOC_RECV_BATCH receives up to count messages, message n into the
+ * len byte buffer at packets[n].data, after which packets[n].len is set to
+ * the message length.  It only waits for the first message.
+ *
+ * Both stop at the first failure.  They return, and store in done, the number
+ * of messages transferred, or return an error if there were none.
+ */
+struct gb_raw_packet {
+	__u64	data;		/* user pointer */
+	__u32	len;
+	__u32	reserved;
+};
+
+struct gb_raw_batch {
+	__u64	packets;	/* user pointer to struct gb_raw_packet[count] */
+	__u32	count;
+	__u32	done;		/* out */
+};
+
+#define GB_RAW_IOC_MAGIC	'g'
+
+#define GB_RAW_IOC_RING_SETUP	_IOWR(GB_RAW_IOC_MAGIC, 0x01,		\
+				      struct gb_raw_ring_setup)
+#define GB_RAW_IOC_TX_KICK	_IO(GB_RAW_IOC_MAGIC, 0x02)
+#define GB_RAW_IOC_SEND_BATCH	_IOWR(GB_RAW_IOC_MAGIC, 0x03,		\
+				      struct gb_raw_batch)
+#define GB_RAW_IOC_RECV_BATCH	_IOWR(GB_RAW_IOC_MAGIC, 0x04,		\
+				      struct gb_raw_batch)
+
+#endif /* __GB_RAW_H */
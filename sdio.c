@@ -16,24 +16,56 @@
 
 #include "greybus.h"
 
+/*
+ * Number of transfer operations kept in flight for a single mmc data
+ * transfer, so that the next chunk is on the wire while the previous one
+ * completes.
+ */
+#define GB_SDIO_TRANSFER_DEPTH_MAX	8
+
+static unsigned int sdio_transfer_depth = 2;
+module_param(sdio_transfer_depth, uint, 0644);
+MODULE_PARM_DESC(sdio_transfer_depth,
+		 "SDIO transfer operations in flight per request for modules "
+		 "that queue them (1-8)");
+
+struct gb_sdio_chunk {
+	struct gb_operation	*operation;
+	size_t			len;
+	off_t			skip;
+	struct scatterlist	*sg;	/* chunk's window of the mmc data */
+	bool			sent;	/* prepared request went out */
+};
+
+/*
+ * Requests prepared by gb_mmc_pre_req(): the mmc core has at most the
+ * current and the next one outstanding.
+ */
+#define GB_SDIO_PREP_SLOTS	2
+
 struct gb_sdio_host {
 	struct gb_connection	*connection;
 	struct mmc_host		*mmc;
 	struct mmc_request	*mrq;
 	struct mutex		lock;	/* lock for this host */
 	size_t			data_max;
-	void			*xfer_buffer;
+	size_t			request_data_max;
+	bool			request_supported;
+	bool			transfer_part;
+	bool			transfer_queue;
+	unsigned long		transfer_ops;
+	unsigned long		transfer_blocks;
 	spinlock_t		xfer;	/* lock to cancel ongoing transfer */
 	bool			xfer_stop;
+	struct workqueue_struct	*mrq_workqueue;
 	struct work_struct	mrqwork;
+	struct gb_sdio_chunk	prep[GB_SDIO_PREP_SLOTS];
 	u8			queued_events;
 	bool			removed;
 	bool			card_present;
 	bool			read_only;
 };
 
-static struct workqueue_struct *gb_sdio_mrq_workqueue;
-
 #define GB_SDIO_RSP_R1_R5_R6_R7	(GB_SDIO_RSP_PRESENT | GB_SDIO_RSP_CRC | \
 				 GB_SDIO_RSP_OPCODE)
 #define GB_SDIO_RSP_R3_R4	(GB_SDIO_RSP_PRESENT)
@@ -87,6 +119,39 @@ static void _gb_sdio_set_host_caps(struct gb_sdio_host *host, u32 r)
 		host->card_present = true;
 }
 
+/*
+ * Agree on the size of transfer parts with the module, offering all of the
+ * payload the host device can carry.
+ */
+static int gb_sdio_transfer_size(struct gb_sdio_host *host)
+{
+	struct gb_sdio_transfer_size_request request;
+	struct gb_sdio_transfer_size_response response;
+	size_t payload_max;
+	size_t size;
+	int ret;
+
+	payload_max = gb_operation_get_payload_size_max(host->connection);
+	size = min(payload_max - sizeof(struct gb_sdio_transfer_part_request),
+		   payload_max - sizeof(struct gb_sdio_transfer_part_response));
+	size = min_t(size_t, size, U16_MAX);
+
+	request.size = cpu_to_le16(size);
+	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER_SIZE,
+				&request, sizeof(request),
+				&response, sizeof(response));
+	if (ret < 0)
+		return ret;
+
+	size = min_t(size_t, le16_to_cpu(response.size), size);
+	if (!size)
+		return -EINVAL;
+
+	host->data_max = size;
+
+	return 0;
+}
+
 static int gb_sdio_get_caps(struct gb_sdio_host *host)
 {
 	struct gb_sdio_get_caps_response response;
@@ -104,17 +169,40 @@ static int gb_sdio_get_caps(struct gb_sdio_host *host)
 
 	_gb_sdio_set_host_caps(host, r);
 
-	/* get the max block size that could fit our payload */
-	data_max = gb_operation_get_payload_size_max(host->connection);
-	data_max = min(data_max - sizeof(struct gb_sdio_transfer_request),
-		       data_max - sizeof(struct gb_sdio_transfer_response));
+	blksz = le16_to_cpu(response.max_blk_size);
 
-	blksz = min(le16_to_cpu(response.max_blk_size), data_max);
+	host->transfer_part = host->connection->module_minor >=
+					GB_SDIO_VERSION_MINOR_TRANSFER_PART;
+	if (host->transfer_part) {
+		/* blocks may span transfer parts */
+		ret = gb_sdio_transfer_size(host);
+		if (ret < 0)
+			return ret;
+	} else {
+		/* get the max block size that could fit our payload */
+		data_max = gb_operation_get_payload_size_max(host->connection);
+		data_max = min(data_max -
+				sizeof(struct gb_sdio_transfer_request),
+			       data_max -
+				sizeof(struct gb_sdio_transfer_response));
+		blksz = min_t(u32, blksz, data_max);
+		host->data_max = data_max;
+	}
 	blksz = max_t(u32, 512, blksz);
 
+	host->transfer_queue = host->connection->module_minor >=
+					GB_SDIO_VERSION_MINOR_TRANSFER_QUEUE;
+
 	mmc->max_blk_size = rounddown_pow_of_two(blksz);
 	mmc->max_blk_count = le16_to_cpu(response.max_blk_count);
-	host->data_max = data_max;
+
+	/* requests whose data fits are executed in one operation */
+	host->request_supported = host->connection->module_minor >=
+					GB_SDIO_VERSION_MINOR_REQUEST;
+	data_max = gb_operation_get_payload_size_max(host->connection);
+	host->request_data_max =
+		min(data_max - sizeof(struct gb_sdio_request_request),
+		    data_max - sizeof(struct gb_sdio_request_response));
 
 	/* get ocr supported values */
 	mmc->ocr_avail = le32_to_cpu(response.ocr);
@@ -211,131 +299,285 @@ static int gb_sdio_set_ios(struct gb_sdio_host *host,
 				 request, sizeof(*request), NULL, 0);
 }
 
-static int _gb_sdio_send(struct gb_sdio_host *host, struct mmc_data *data,
-			 size_t len, u16 nblocks, off_t skip)
+static void gb_sdio_transfer_callback(struct gb_operation *operation)
 {
-	struct gb_sdio_transfer_request *request;
-	struct gb_sdio_transfer_response response;
-	struct scatterlist *sg = data->sg;
-	unsigned int sg_len = data->sg_len;
-	size_t copied;
-	u16 send_blksz;
-	u16 send_blocks;
-	int ret;
+	complete(&operation->completion);
+}
 
-	WARN_ON(len > host->data_max);
+/*
+ * Build a scatterlist describing the chunk's len bytes of the mmc data,
+ * starting skip bytes in.  It references the mmc pages, so nothing is
+ * copied.  Returns the number of entries, or a negative errno.
+ */
+static int _gb_sdio_chunk_map(struct mmc_data *data,
+			      struct gb_sdio_chunk *chunk)
+{
+	struct scatterlist *sg;
+	size_t skip = chunk->skip;
+	size_t left = chunk->len;
+	unsigned int nents = 0;
+	unsigned int offset;
+	size_t len;
+	int i;
 
-	request = host->xfer_buffer;
-	request->data_flags = (data->flags >> 8);
-	request->data_blocks = cpu_to_le16(nblocks);
-	request->data_blksz = cpu_to_le16(data->blksz);
+	chunk->sg = kmalloc_array(data->sg_len, sizeof(*chunk->sg),
+				  GFP_KERNEL);
+	if (!chunk->sg)
+		return -ENOMEM;
+	sg_init_table(chunk->sg, data->sg_len);
+
+	for_each_sg(data->sg, sg, data->sg_len, i) {
+		if (!left)
+			break;
+		if (skip >= sg->length) {
+			skip -= sg->length;
+			continue;
+		}
 
-	copied = sg_pcopy_to_buffer(sg, sg_len, &request->data[0], len, skip);
+		len = min_t(size_t, sg->length - skip, left);
+		offset = sg->offset + skip;
+		sg_set_page(&chunk->sg[nents++],
+			    nth_page(sg_page(sg), offset >> PAGE_SHIFT),
+			    len, offset & ~PAGE_MASK);
+		left -= len;
+		skip = 0;
+	}
 
-	if (copied != len)
+	if (left) {
+		kfree(chunk->sg);
+		chunk->sg = NULL;
 		return -EINVAL;
+	}
+	sg_mark_end(&chunk->sg[nents - 1]);
 
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER,
-				request, len + sizeof(*request),
-				&response, sizeof(response));
-	if (ret < 0)
-		return ret;
+	return nents;
+}
 
-	send_blocks = le16_to_cpu(response.data_blocks);
-	send_blksz = le16_to_cpu(response.data_blksz);
+/*
+ * Start the transfer of one chunk of data.  The data is carried in the
+ * chunk's scatterlist, so writes are sent from and reads land in the mmc
+ * pages directly.  Chunks are whole-block transfers, or transfer parts if
+ * the module supports them.
+ */
+static int _gb_sdio_chunk_start(struct gb_sdio_host *host,
+				struct mmc_data *data,
+				struct gb_sdio_chunk *chunk)
+{
+	struct gb_sdio_transfer_request *request;
+	struct gb_sdio_transfer_part_request *part;
+	struct gb_operation *operation;
+	struct gb_message *message;
+	size_t request_size = sizeof(*request);
+	size_t response_size = sizeof(struct gb_sdio_transfer_response);
+	size_t request_sg_size = 0;
+	size_t response_sg_size = 0;
+	u8 type = GB_SDIO_TYPE_TRANSFER;
+	int nents;
+	int ret;
 
-	if (len != send_blksz * send_blocks) {
-		dev_err(mmc_dev(host->mmc), "send: size received: %zu != %d\n",
-			len, send_blksz * send_blocks);
-		return -EINVAL;
+	WARN_ON(chunk->len > host->data_max);
+
+	if (data->flags & MMC_DATA_READ)
+		response_sg_size = chunk->len;
+	else
+		request_sg_size = chunk->len;
+
+	if (host->transfer_part) {
+		type = GB_SDIO_TYPE_TRANSFER_PART;
+		request_size = sizeof(*part);
+		response_size = sizeof(struct gb_sdio_transfer_part_response);
+	}
+
+	nents = _gb_sdio_chunk_map(data, chunk);
+	if (nents < 0)
+		return nents;
+
+	operation = gb_operation_create_sg(host->connection, type,
+					   request_size, request_sg_size,
+					   response_size, response_sg_size,
+					   GFP_KERNEL);
+	if (!operation) {
+		ret = -ENOMEM;
+		goto err_free_sg;
 	}
 
+	if (host->transfer_part) {
+		part = operation->request->payload;
+		part->data_flags = (data->flags >> 8);
+		part->data_blocks = cpu_to_le16(data->blocks);
+		part->data_blksz = cpu_to_le16(data->blksz);
+		part->offset = cpu_to_le32(chunk->skip);
+		part->len = cpu_to_le16(chunk->len);
+	} else {
+		request = operation->request->payload;
+		request->data_flags = (data->flags >> 8);
+		request->data_blocks = cpu_to_le16(chunk->len / data->blksz);
+		request->data_blksz = cpu_to_le16(data->blksz);
+	}
+
+	if (data->flags & MMC_DATA_READ)
+		message = operation->response;
+	else
+		message = operation->request;
+	gb_message_set_sg(message, chunk->sg, nents);
+
+	ret = gb_operation_request_send(operation, gb_sdio_transfer_callback,
+					GFP_KERNEL);
+	if (ret)
+		goto err_put;
+
+	chunk->operation = operation;
+
+	return 0;
+
+err_put:
+	gb_operation_put(operation);
+err_free_sg:
+	kfree(chunk->sg);
+	chunk->sg = NULL;
+
 	return ret;
 }
 
-static int _gb_sdio_recv(struct gb_sdio_host *host, struct mmc_data *data,
-			 size_t len, u16 nblocks, off_t skip)
+static void _gb_sdio_chunk_release(struct gb_sdio_chunk *chunk)
 {
-	struct gb_sdio_transfer_request request;
+	gb_operation_put(chunk->operation);
+	chunk->operation = NULL;
+	kfree(chunk->sg);
+	chunk->sg = NULL;
+}
+
+/*
+ * Wait for a chunk started by _gb_sdio_chunk_start() to complete and check
+ * its result.  The chunk's operation is released in all cases.
+ */
+static int _gb_sdio_chunk_finish(struct gb_sdio_host *host,
+				 struct mmc_data *data,
+				 struct gb_sdio_chunk *chunk)
+{
+	struct gb_operation *operation = chunk->operation;
 	struct gb_sdio_transfer_response *response;
-	struct scatterlist *sg = data->sg;
-	unsigned int sg_len = data->sg_len;
-	size_t copied;
-	u16 recv_blksz;
-	u16 recv_blocks;
+	struct gb_sdio_transfer_part_response *part;
+	unsigned long timeout;
+	size_t len;
 	int ret;
 
-	WARN_ON(len > host->data_max);
-
-	request.data_flags = (data->flags >> 8);
-	request.data_blocks = cpu_to_le16(nblocks);
-	request.data_blksz = cpu_to_le16(data->blksz);
-
-	response = host->xfer_buffer;
-
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER,
-				&request, sizeof(request), response, len +
-				sizeof(*response));
+	timeout = msecs_to_jiffies(GB_OPERATION_TIMEOUT_DEFAULT);
+	ret = wait_for_completion_interruptible_timeout(&operation->completion,
+							timeout);
 	if (ret < 0)
-		return ret;
+		gb_operation_cancel(operation, -ECANCELED);
+	else if (ret == 0)
+		gb_operation_cancel(operation, -ETIMEDOUT);
 
-	recv_blocks = le16_to_cpu(response->data_blocks);
-	recv_blksz = le16_to_cpu(response->data_blksz);
+	ret = gb_operation_result(operation);
+	if (ret) {
+		dev_err(&host->connection->dev, "transfer failed: %d\n", ret);
+		goto out;
+	}
 
-	if (len != recv_blksz * recv_blocks) {
-		dev_err(mmc_dev(host->mmc), "recv: size received: %d != %zu\n",
-			recv_blksz * recv_blocks, len);
-		return -EINVAL;
+	if (host->transfer_part) {
+		part = operation->response->payload;
+		len = le16_to_cpu(part->len);
+	} else {
+		response = operation->response->payload;
+		len = le16_to_cpu(response->data_blocks) *
+			le16_to_cpu(response->data_blksz);
 	}
 
-	copied = sg_pcopy_from_buffer(sg, sg_len, &response->data[0], len,
-				      skip);
-	if (copied != len)
-		return -EINVAL;
+	if (chunk->len != len) {
+		dev_err(mmc_dev(host->mmc), "%s: size received: %zu != %zu\n",
+			data->flags & MMC_DATA_READ ? "recv" : "send",
+			len, chunk->len);
+		ret = -EINVAL;
+		goto out;
+	}
 
-	return 0;
+out:
+	_gb_sdio_chunk_release(chunk);
+
+	return ret;
 }
 
+/*
+ * Transfer the data of a request in chunks of at most data_max bytes,
+ * keeping up to sdio_transfer_depth chunks in flight if the module queues
+ * them, or one otherwise.  Chunks complete in the order they were started.
+ */
 static int gb_sdio_transfer(struct gb_sdio_host *host, struct mmc_data *data)
 {
-	size_t left, len;
+	struct gb_sdio_chunk chunks[GB_SDIO_TRANSFER_DEPTH_MAX];
+	unsigned int depth;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	size_t left;
+	size_t len;
 	off_t skip = 0;
 	int ret = 0;
-	u16 nblocks;
 
 	if (single_op(data->mrq->cmd) && data->blocks > 1) {
 		ret = -ETIMEDOUT;
 		goto out;
 	}
 
+	if (host->transfer_queue)
+		depth = clamp_t(unsigned int, ACCESS_ONCE(sdio_transfer_depth),
+				1, GB_SDIO_TRANSFER_DEPTH_MAX);
+	else
+		depth = 1;
 	left = data->blksz * data->blocks;
 
-	while (left) {
-		/* check is a stop transmission is pending */
-		spin_lock(&host->xfer);
-		if (host->xfer_stop) {
-			host->xfer_stop = false;
+	while (left || head != tail) {
+		if (left && head - tail < depth) {
+			/* check is a stop transmission is pending */
+			spin_lock(&host->xfer);
+			if (host->xfer_stop) {
+				host->xfer_stop = false;
+				spin_unlock(&host->xfer);
+				ret = -EINTR;
+				break;
+			}
 			spin_unlock(&host->xfer);
-			ret = -EINTR;
-			goto out;
-		}
-		spin_unlock(&host->xfer);
-		len = min(left, host->data_max);
-		nblocks = len / data->blksz;
-		len = nblocks * data->blksz;
 
-		if (data->flags & MMC_DATA_READ) {
-			ret = _gb_sdio_recv(host, data, len, nblocks, skip);
-			if (ret < 0)
-				goto out;
-		} else {
-			ret = _gb_sdio_send(host, data, len, nblocks, skip);
+			len = min(left, host->data_max);
+			if (!host->transfer_part)
+				len = rounddown(len, data->blksz);
+
+			chunks[head % depth].len = len;
+			chunks[head % depth].skip = skip;
+			ret = _gb_sdio_chunk_start(host, data,
+						   &chunks[head % depth]);
 			if (ret < 0)
-				goto out;
+				break;
+
+			head++;
+			left -= len;
+			skip += len;
+			continue;
 		}
-		data->bytes_xfered += len;
-		left -= len;
-		skip += len;
+
+		ret = _gb_sdio_chunk_finish(host, data, &chunks[tail % depth]);
+		if (ret < 0) {
+			tail++;
+			break;
+		}
+
+		data->bytes_xfered += chunks[tail % depth].len;
+		tail++;
+	}
+
+	/* On error, cancel whatever is still in flight */
+	for (; tail != head; tail++) {
+		gb_operation_cancel(chunks[tail % depth].operation, -ECANCELED);
+		_gb_sdio_chunk_release(&chunks[tail % depth]);
+	}
+
+	if (ret) {
+		/* a block split across transfer parts may be incomplete */
+		data->bytes_xfered = rounddown(data->bytes_xfered, data->blksz);
+	} else {
+		host->transfer_ops += head;
+		host->transfer_blocks += data->blocks;
 	}
 
 out:
@@ -343,14 +585,12 @@ out:
 	return ret;
 }
 
-static int gb_sdio_command(struct gb_sdio_host *host, struct mmc_command *cmd)
+static int gb_sdio_command_init(struct gb_sdio_host *host,
+				struct mmc_command *cmd,
+				struct gb_sdio_command_request *request)
 {
-	struct gb_sdio_command_request request;
-	struct gb_sdio_command_response response;
 	u8 cmd_flags;
 	u8 cmd_type;
-	int i;
-	int ret = 0;
 
 	switch (mmc_resp_type(cmd)) {
 	case MMC_RSP_NONE:
@@ -371,8 +611,7 @@ static int gb_sdio_command(struct gb_sdio_host *host, struct mmc_command *cmd)
 	default:
 		dev_err(mmc_dev(host->mmc), "cmd flag invalid %04x\n",
 			mmc_resp_type(cmd));
-		ret = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
 	switch (mmc_cmd_type(cmd)) {
@@ -391,37 +630,281 @@ static int gb_sdio_command(struct gb_sdio_host *host, struct mmc_command *cmd)
 	default:
 		dev_err(mmc_dev(host->mmc), "cmd type invalid %04x\n",
 			mmc_cmd_type(cmd));
-		ret = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
-	request.cmd = cmd->opcode;
-	request.cmd_flags = cmd_flags;
-	request.cmd_type = cmd_type;
-	request.cmd_arg = cpu_to_le32(cmd->arg);
+	request->cmd = cmd->opcode;
+	request->cmd_flags = cmd_flags;
+	request->cmd_type = cmd_type;
+	request->cmd_arg = cpu_to_le32(cmd->arg);
 
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_COMMAND,
-				&request, sizeof(request), &response,
-				sizeof(response));
-	if (ret < 0)
-		goto out;
+	return 0;
+}
+
+static void gb_sdio_command_resp(struct mmc_command *cmd, u8 cmd_flags,
+				 struct gb_sdio_command_response *response)
+{
+	int i;
 
 	/* no response expected */
 	if (cmd_flags & GB_SDIO_RSP_NONE)
-		goto out;
+		return;
 
 	/* long response expected */
 	if (cmd_flags & GB_SDIO_RSP_R2)
 		for (i = 0; i < 4; i++)
-			cmd->resp[i] = le32_to_cpu(response.resp[i]);
+			cmd->resp[i] = le32_to_cpu(response->resp[i]);
 	else
-		cmd->resp[0] = le32_to_cpu(response.resp[0]);
+		cmd->resp[0] = le32_to_cpu(response->resp[0]);
+}
+
+static int gb_sdio_command(struct gb_sdio_host *host, struct mmc_command *cmd)
+{
+	struct gb_sdio_command_request request;
+	struct gb_sdio_command_response response;
+	int ret;
+
+	ret = gb_sdio_command_init(host, cmd, &request);
+	if (ret < 0)
+		goto out;
+
+	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_COMMAND,
+				&request, sizeof(request), &response,
+				sizeof(response));
+	if (ret < 0)
+		goto out;
+
+	gb_sdio_command_resp(cmd, request.cmd_flags, &response);
 
 out:
 	cmd->error = ret;
 	return ret;
 }
 
+static int gb_sdio_status_map(u8 status)
+{
+	switch (status) {
+	case GB_SDIO_STATUS_OK:
+		return 0;
+	case GB_SDIO_STATUS_TIMEOUT:
+		return -ETIMEDOUT;
+	case GB_SDIO_STATUS_CRC:
+		return -EILSEQ;
+	case GB_SDIO_STATUS_ERROR:
+	default:
+		return -EIO;
+	}
+}
+
+static void gb_sdio_request_resp(struct mmc_command *cmd, u8 cmd_flags,
+				 u8 status,
+				 struct gb_sdio_command_response *response)
+{
+	cmd->error = gb_sdio_status_map(status);
+	if (!cmd->error)
+		gb_sdio_command_resp(cmd, cmd_flags, response);
+}
+
+/*
+ * Whether an mmc request can be executed with a single request operation,
+ * rather than a command and transfer operation per stage.
+ */
+static bool gb_sdio_request_fits(struct gb_sdio_host *host,
+				 struct mmc_request *mrq)
+{
+	struct mmc_data *data = mrq->data;
+
+	if (!host->request_supported)
+		return false;
+	if (!data)
+		return true;
+	if (single_op(mrq->cmd) && data->blocks > 1)
+		return false;
+
+	return data->blksz * data->blocks <= host->request_data_max;
+}
+
+/*
+ * Build the request operation for an mmc request, leaving it and the data
+ * scatterlist in prep.
+ */
+static int gb_sdio_request_prepare(struct gb_sdio_host *host,
+				   struct mmc_request *mrq,
+				   struct gb_sdio_chunk *prep)
+{
+	struct gb_sdio_request_request *request;
+	struct mmc_data *data = mrq->data;
+	struct gb_operation *operation;
+	struct gb_message *message;
+	size_t request_sg_size = 0;
+	size_t response_sg_size = 0;
+	int nents = 0;
+	int ret;
+
+	prep->len = 0;
+	prep->skip = 0;
+	prep->sg = NULL;
+	prep->sent = false;
+
+	if (data) {
+		prep->len = data->blksz * data->blocks;
+		if (data->flags & MMC_DATA_READ)
+			response_sg_size = prep->len;
+		else
+			request_sg_size = prep->len;
+
+		nents = _gb_sdio_chunk_map(data, prep);
+		if (nents < 0)
+			return nents;
+	}
+
+	operation = gb_operation_create_sg(host->connection,
+				GB_SDIO_TYPE_REQUEST,
+				sizeof(*request), request_sg_size,
+				sizeof(struct gb_sdio_request_response),
+				response_sg_size, GFP_KERNEL);
+	if (!operation) {
+		ret = -ENOMEM;
+		goto err_free_sg;
+	}
+
+	request = operation->request->payload;
+	ret = gb_sdio_command_init(host, mrq->cmd, &request->cmd);
+	if (ret < 0)
+		goto err_put;
+
+	if (mrq->sbc) {
+		request->flags |= GB_SDIO_REQUEST_SBC;
+		ret = gb_sdio_command_init(host, mrq->sbc, &request->sbc);
+		if (ret < 0)
+			goto err_put;
+	}
+
+	if (mrq->stop) {
+		request->flags |= GB_SDIO_REQUEST_STOP;
+		ret = gb_sdio_command_init(host, mrq->stop, &request->stop);
+		if (ret < 0)
+			goto err_put;
+	}
+
+	if (data) {
+		request->flags |= GB_SDIO_REQUEST_DATA;
+		request->data_flags = (data->flags >> 8);
+		request->data_blocks = cpu_to_le16(data->blocks);
+		request->data_blksz = cpu_to_le16(data->blksz);
+
+		if (data->flags & MMC_DATA_READ)
+			message = operation->response;
+		else
+			message = operation->request;
+		gb_message_set_sg(message, prep->sg, nents);
+	}
+
+	prep->operation = operation;
+
+	return 0;
+
+err_put:
+	gb_operation_put(operation);
+err_free_sg:
+	kfree(prep->sg);
+	prep->sg = NULL;
+
+	return ret;
+}
+
+/*
+ * Execute an mmc request with a single request operation, using the one
+ * built by gb_mmc_pre_req() if there is one.
+ */
+static int gb_sdio_request(struct gb_sdio_host *host, struct mmc_request *mrq)
+{
+	struct gb_sdio_request_request *request;
+	struct gb_sdio_request_response *response;
+	struct mmc_data *data = mrq->data;
+	struct gb_sdio_chunk chunk = { };
+	struct gb_sdio_chunk *prep = &chunk;
+	struct gb_operation *operation;
+	int ret;
+
+	if (data) {
+		/* check is a stop transmission is pending */
+		spin_lock(&host->xfer);
+		if (host->xfer_stop) {
+			host->xfer_stop = false;
+			spin_unlock(&host->xfer);
+			data->error = -EINTR;
+			return -EINTR;
+		}
+		spin_unlock(&host->xfer);
+
+		/*
+		 * A prepared operation can only be sent once; build a new
+		 * one if the request is being retried.
+		 */
+		if (data->host_cookie) {
+			prep = &host->prep[data->host_cookie - 1];
+			if (prep->sent)
+				prep = &chunk;
+		}
+	}
+
+	if (!prep->operation) {
+		ret = gb_sdio_request_prepare(host, mrq, prep);
+		if (ret < 0)
+			goto out;
+	}
+	operation = prep->operation;
+	request = operation->request->payload;
+
+	prep->sent = true;
+	ret = gb_operation_request_send_sync(operation);
+	if (ret) {
+		dev_err(&host->connection->dev, "request failed: %d\n", ret);
+		goto out_release;
+	}
+
+	response = operation->response->payload;
+
+	if (mrq->sbc)
+		gb_sdio_request_resp(mrq->sbc, request->sbc.cmd_flags,
+				     response->sbc_status, &response->sbc_resp);
+	gb_sdio_request_resp(mrq->cmd, request->cmd.cmd_flags,
+			     response->cmd_status, &response->cmd_resp);
+
+	if (data) {
+		data->error = gb_sdio_status_map(response->data_status);
+		if (!data->error &&
+		    le16_to_cpu(response->data_blocks) *
+		    le16_to_cpu(response->data_blksz) != prep->len) {
+			dev_err(mmc_dev(host->mmc), "size received: %d != %zu\n",
+				le16_to_cpu(response->data_blocks) *
+				le16_to_cpu(response->data_blksz), prep->len);
+			data->error = -EINVAL;
+		}
+		if (!data->error) {
+			data->bytes_xfered = prep->len;
+			host->transfer_ops++;
+			host->transfer_blocks += data->blocks;
+		}
+	}
+
+	if (mrq->stop)
+		gb_sdio_request_resp(mrq->stop, request->stop.cmd_flags,
+				     response->stop_status,
+				     &response->stop_resp);
+
+out_release:
+	/* prepared operations are released by gb_mmc_post_req() */
+	if (prep == &chunk)
+		_gb_sdio_chunk_release(&chunk);
+out:
+	if (ret)
+		mrq->cmd->error = ret;
+
+	return ret;
+}
+
 static void gb_sdio_mrq_work(struct work_struct *work)
 {
 	struct gb_sdio_host *host;
@@ -443,6 +926,11 @@ static void gb_sdio_mrq_work(struct work_struct *work)
 		goto done;
 	}
 
+	if (gb_sdio_request_fits(host, mrq)) {
+		gb_sdio_request(host, mrq);
+		goto done;
+	}
+
 	if (mrq->sbc) {
 		ret = gb_sdio_command(host, mrq->sbc);
 		if (ret < 0)
@@ -497,7 +985,7 @@ static void gb_mmc_request(struct mmc_host *mmc, struct mmc_request *mrq)
 		goto out;
 	}
 
-	queue_work(gb_sdio_mrq_workqueue, &host->mrqwork);
+	queue_work(host->mrq_workqueue, &host->mrqwork);
 
 	mutex_unlock(&host->lock);
 	return;
@@ -643,6 +1131,53 @@ out:
 	mutex_unlock(&host->lock);
 }
 
+/*
+ * Build the operation for the next request while the current one is being
+ * executed.  pre_req and post_req are called from the mmc core's request
+ * thread only, so they don't race for the slots.
+ */
+#ifdef MMC_PRE_REQ_HAS_FIRST_REQ
+static void gb_mmc_pre_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			   bool is_first_req)
+#else
+static void gb_mmc_pre_req(struct mmc_host *mmc, struct mmc_request *mrq)
+#endif
+{
+	struct gb_sdio_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	int i;
+
+	if (!data || data->host_cookie)
+		return;
+	if (!gb_sdio_request_fits(host, mrq))
+		return;
+
+	for (i = 0; i < GB_SDIO_PREP_SLOTS; i++) {
+		if (!host->prep[i].operation)
+			break;
+	}
+	if (i == GB_SDIO_PREP_SLOTS)
+		return;
+
+	if (gb_sdio_request_prepare(host, mrq, &host->prep[i]) < 0)
+		return;
+
+	data->host_cookie = i + 1;
+}
+
+static void gb_mmc_post_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			    int err)
+{
+	struct gb_sdio_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+
+	if (!data || !data->host_cookie)
+		return;
+
+	_gb_sdio_chunk_release(&host->prep[data->host_cookie - 1]);
+	data->host_cookie = 0;
+}
+
 static int gb_mmc_get_ro(struct mmc_host *mmc)
 {
 	struct gb_sdio_host *host = mmc_priv(mmc);
@@ -665,8 +1200,52 @@ static int gb_mmc_get_cd(struct mmc_host *mmc)
 	return host->card_present;
 }
 
+/* The attributes live on the mmc host's class device */
+static struct gb_sdio_host *gb_sdio_dev_to_host(struct device *dev)
+{
+	return mmc_priv(container_of(dev, struct mmc_host, class_dev));
+}
+
+#define gb_sdio_counter_attr(field)					\
+static ssize_t field##_show(struct device *dev,				\
+			    struct device_attribute *attr,		\
+			    char *buf)					\
+{									\
+	struct gb_sdio_host *host = gb_sdio_dev_to_host(dev);		\
+	return sprintf(buf, "%lu\n", host->field);			\
+}									\
+static DEVICE_ATTR_RO(field)
+
+gb_sdio_counter_attr(transfer_ops);
+gb_sdio_counter_attr(transfer_blocks);
+
+static ssize_t blocks_per_op_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct gb_sdio_host *host = gb_sdio_dev_to_host(dev);
+	unsigned long ops = ACCESS_ONCE(host->transfer_ops);
+	unsigned long blocks = ACCESS_ONCE(host->transfer_blocks);
+
+	if (!ops)
+		return sprintf(buf, "0.00\n");
+
+	return sprintf(buf, "%lu.%02lu\n", blocks / ops,
+		       (blocks % ops) * 100 / ops);
+}
+static DEVICE_ATTR_RO(blocks_per_op);
+
+static struct attribute *sdio_attrs[] = {
+	&dev_attr_transfer_ops.attr,
+	&dev_attr_transfer_blocks.attr,
+	&dev_attr_blocks_per_op.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(sdio);
+
 static const struct mmc_host_ops gb_sdio_ops = {
 	.request	= gb_mmc_request,
+	.pre_req	= gb_mmc_pre_req,
+	.post_req	= gb_mmc_post_req,
 	.set_ios	= gb_mmc_set_ios,
 	.get_ro		= gb_mmc_get_ro,
 	.get_cd		= gb_mmc_get_cd,
@@ -676,7 +1255,6 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 {
 	struct mmc_host *mmc;
 	struct gb_sdio_host *host;
-	size_t max_buffer;
 	int ret = 0;
 
 	mmc = mmc_alloc_host(sizeof(*host), &connection->dev);
@@ -702,17 +1280,20 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 
 	mmc->max_req_size = mmc->max_blk_size * mmc->max_blk_count;
 
-	max_buffer = gb_operation_get_payload_size_max(host->connection);
-	host->xfer_buffer = kzalloc(max_buffer, GFP_KERNEL);
-	if (!host->xfer_buffer) {
+	mutex_init(&host->lock);
+	spin_lock_init(&host->xfer);
+	host->mrq_workqueue = alloc_workqueue("gb_sdio_mrq_%s",
+					     WQ_MEM_RECLAIM, 1,
+					     mmc_hostname(mmc));
+	if (!host->mrq_workqueue) {
 		ret = -ENOMEM;
 		goto free_mmc;
 	}
-	mutex_init(&host->lock);
-	spin_lock_init(&host->xfer);
-	gb_sdio_mrq_workqueue = alloc_workqueue("gb_sdio_mrq", 0, 1);
 	INIT_WORK(&host->mrqwork, gb_sdio_mrq_work);
 
+	/* registered along with the host, before its uevent goes out */
+	mmc->class_dev.groups = sdio_groups;
+
 	ret = mmc_add_host(mmc);
 	if (ret < 0)
 		goto free_work;
@@ -723,8 +1304,7 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 	return ret;
 
 free_work:
-	destroy_workqueue(gb_sdio_mrq_workqueue);
-	kfree(host->xfer_buffer);
+	destroy_workqueue(host->mrq_workqueue);
 
 free_mmc:
 	connection->private = NULL;
@@ -747,11 +1327,10 @@ static void gb_sdio_connection_exit(struct gb_connection *connection)
 	connection->private = NULL;
 	mutex_unlock(&host->lock);
 
-	flush_workqueue(gb_sdio_mrq_workqueue);
-	destroy_workqueue(gb_sdio_mrq_workqueue);
+	flush_workqueue(host->mrq_workqueue);
+	destroy_workqueue(host->mrq_workqueue);
 	mmc_remove_host(mmc);
 	mmc_free_host(mmc);
-	kfree(host->xfer_buffer);
 }
 
 static struct gb_protocol sdio_protocol = {
@@ -12,9 +12,25 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "greybus.h"
 
+/*
+ * Maximum number of transfer operations sent to the module before the
+ * oldest completes.  The module doesn't report how many it can queue, so
+ * modules that can queue any get the transfer_window parameter, and others
+ * a window of one.
+ */
+#define GB_SPI_TRANSFER_WINDOW_MAX	16
+
+static unsigned int transfer_window = 4;
+module_param(transfer_window, uint, 0644);
+MODULE_PARM_DESC(transfer_window,
+		 "SPI transfer operations in flight per master (1-16)");
+
 struct gb_spi {
 	struct gb_connection	*connection;
 
@@ -39,131 +55,608 @@ struct gb_spi {
 	 * use board-specific GPIOs.
 	 */
 	u16			num_chipselect;
+
+	size_t			payload_max;
+	bool			split;		/* messages may be split */
+	bool			pipeline;	/* window may exceed one */
+
+	spinlock_t		lock;		/* protects the lists */
+	struct list_head	queue;		/* messages waiting to be sent */
+	struct list_head	segments;	/* sent segments, oldest first */
+	unsigned int		inflight_count;
+	struct work_struct	work;
+	bool			removed;	/* no more work is queued */
+
+	/* message being sent by gb_spi_work(), and how far it has got */
+	struct spi_message	*msg;
+	struct spi_transfer	*xfer;
+	u32			offset;
 };
 
 /* Routines to transfer data */
-static struct gb_operation *
-gb_spi_operation_create(struct gb_connection *connection,
-			struct spi_message *msg, u32 *total_len)
+
+/*
+ * Messages too big for a single operation are split into segments, each
+ * sent as one transfer operation.  A segment covers a run of transfers,
+ * the first and last of which may be pieces of a larger transfer.
+ */
+struct gb_spi_segment {
+	struct list_head	links;		/* gb_spi->segments */
+	struct spi_message	*msg;
+	struct gb_operation	*operation;
+	struct spi_transfer	*xfer;		/* first transfer */
+	u32			offset;		/* into the first transfer */
+	u32			len;		/* bytes covered */
+	u16			count;		/* transfer descriptors */
+	bool			last;		/* completes the message */
+	bool			copy;		/* data copied, not gathered */
+	struct scatterlist	*sg;		/* tx then rx entries */
+	int			status;
+};
+
+static unsigned int gb_spi_word_size(struct spi_device *dev,
+				     struct spi_transfer *xfer)
 {
-	struct gb_spi_transfer_request *request;
-	struct spi_device *dev = msg->spi;
-	struct spi_transfer *xfer;
-	struct gb_spi_transfer *gb_xfer;
-	struct gb_operation *operation;
-	u32 tx_size = 0, rx_size = 0, count = 0, request_size;
-	void *tx_data;
+	u8 bits_per_word = xfer->bits_per_word ?: dev->bits_per_word;
 
-	/* Find number of transfers queued and tx/rx length in the message */
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
+	if (bits_per_word <= 8)
+		return 1;
+	if (bits_per_word <= 16)
+		return 2;
+	return 4;
+}
+
+/*
+ * Work out how much of the message, starting offset bytes into xfer, fits
+ * in one operation.  Fills in the segment's extent and returns 0, or a
+ * negative errno if nothing fits, or if the module can't take split
+ * messages and the whole message doesn't fit.
+ */
+static int gb_spi_segment_size(struct gb_spi *spi, struct spi_message *msg,
+			       struct gb_spi_segment *seg)
+{
+	struct gb_spi_transfer_request *request;
+	struct spi_transfer *xfer = seg->xfer;
+	size_t payload_max = spi->payload_max;
+	size_t tx_size = 0, rx_size = 0;
+	size_t tx_room, rx_room;
+	u32 offset = seg->offset;
+	bool whole = false;
+	u32 piece;
+
+	seg->len = 0;
+	seg->count = 0;
+
+	while (seg->count < U16_MAX) {
 		if (!xfer->tx_buf && !xfer->rx_buf) {
-			dev_err(&connection->dev,
+			dev_err(&spi->connection->dev,
 				"bufferless transfer, length %u\n", xfer->len);
-			return NULL;
+			return -EINVAL;
 		}
 
+		/* Room for this transfer's descriptor and data */
+		tx_room = sizeof(*request) + (seg->count + 1) *
+				sizeof(struct gb_spi_transfer) + tx_size;
+		if (tx_room >= payload_max)
+			break;
+		tx_room = payload_max - tx_room;
+		rx_room = payload_max - rx_size;
+
+		piece = xfer->len - offset;
+		if (xfer->tx_buf)
+			piece = min_t(size_t, piece, tx_room);
+		if (xfer->rx_buf)
+			piece = min_t(size_t, piece, rx_room);
+		if (piece < xfer->len - offset)
+			piece = rounddown(piece, gb_spi_word_size(msg->spi,
+								  xfer));
+		if (!piece && xfer->len)
+			break;
+
 		if (xfer->tx_buf)
-			tx_size += xfer->len;
+			tx_size += piece;
 		if (xfer->rx_buf)
-			rx_size += xfer->len;
+			rx_size += piece;
+		seg->len += piece;
+		seg->count++;
+
+		/* The rest of a split transfer goes in the next segment */
+		if (piece < xfer->len - offset)
+			break;
 
-		*total_len += xfer->len;
-		count++;
+		if (list_is_last(&xfer->transfer_list, &msg->transfers)) {
+			whole = true;
+			break;
+		}
+		xfer = list_next_entry(xfer, transfer_list);
+		offset = 0;
 	}
 
-	/* Too many transfers ? */
-	if (count > (u32)U16_MAX) {
-		dev_err(&connection->dev, "transfer count (%u) too big\n",
-			count);
-		return NULL;
+	if (!whole && !spi->split)
+		return -EMSGSIZE;
+
+	return seg->count ? 0 : -EMSGSIZE;
+}
+
+/*
+ * Number of scatterlist entries describing a transfer buffer, or -EINVAL
+ * if it can't be described by one.
+ */
+static int gb_spi_sg_nents(const void *buf, u32 len)
+{
+	if (!len)
+		return 0;
+	if (virt_addr_valid(buf))
+		return 1;
+	if (is_vmalloc_addr(buf))
+		return DIV_ROUND_UP(offset_in_page(buf) + len, PAGE_SIZE);
+
+	return -EINVAL;
+}
+
+static struct scatterlist *gb_spi_sg_fill(struct scatterlist *sg,
+					  const void *buf, u32 len)
+{
+	u32 piece;
+
+	if (!len)
+		return sg;
+
+	if (virt_addr_valid(buf)) {
+		sg_set_buf(sg, buf, len);
+		return sg + 1;
+	}
+
+	while (len) {
+		piece = min_t(u32, len, PAGE_SIZE - offset_in_page(buf));
+		sg_set_page(sg++, vmalloc_to_page(buf), piece,
+			    offset_in_page(buf));
+		buf += piece;
+		len -= piece;
+	}
+
+	return sg;
+}
+
+/*
+ * Build the transfer operation for a segment.  The tx data is sent from,
+ * and the rx data received into, the transfer buffers themselves; only the
+ * transfer descriptors are built here.  Buffers that can't be described by
+ * a scatterlist are copied instead.
+ */
+static struct gb_operation *
+gb_spi_operation_create(struct gb_spi *spi, struct spi_message *msg,
+			struct gb_spi_segment *seg)
+{
+	struct gb_connection *connection = spi->connection;
+	struct gb_spi_transfer_request *request;
+	struct spi_device *dev = msg->spi;
+	struct spi_transfer *xfer;
+	struct gb_spi_transfer *gb_xfer;
+	struct gb_operation *operation;
+	struct scatterlist *tx_sg = NULL;
+	struct scatterlist *rx_sg = NULL;
+	u32 tx_size = 0, rx_size = 0, request_size;
+	int tx_nents = 0, rx_nents = 0, nents;
+	u32 offset = seg->offset;
+	u32 left = seg->len;
+	u32 piece;
+	bool last_xfer;
+	void *tx_data = NULL;
+	int i;
+
+	/* Find the tx/rx length of the segment, and how to describe it */
+	xfer = seg->xfer;
+	for (i = 0; i < seg->count; i++) {
+		piece = min(xfer->len - offset, left);
+		if (xfer->tx_buf) {
+			tx_size += piece;
+			nents = gb_spi_sg_nents(xfer->tx_buf + offset, piece);
+			if (nents < 0)
+				seg->copy = true;
+			tx_nents += nents;
+		}
+		if (xfer->rx_buf) {
+			rx_size += piece;
+			nents = gb_spi_sg_nents(xfer->rx_buf + offset, piece);
+			if (nents < 0)
+				seg->copy = true;
+			rx_nents += nents;
+		}
+		left -= piece;
+		offset = 0;
+		xfer = list_next_entry(xfer, transfer_list);
 	}
 
-	/*
-	 * In addition to space for all message descriptors we need
-	 * to have enough to hold all tx data.
-	 */
 	request_size = sizeof(*request);
-	request_size += count * sizeof(*gb_xfer);
-	request_size += tx_size;
+	request_size += seg->count * sizeof(*gb_xfer);
+
+	if (seg->copy) {
+		/*
+		 * In addition to space for all message descriptors we need
+		 * to have enough to hold all tx data.  The response consists
+		 * only of incoming data.
+		 */
+		operation = gb_operation_create(connection,
+						GB_SPI_TYPE_TRANSFER,
+						request_size + tx_size,
+						rx_size, GFP_KERNEL);
+	} else {
+		seg->sg = kmalloc_array(tx_nents + rx_nents, sizeof(*seg->sg),
+					GFP_KERNEL);
+		if (!seg->sg && tx_nents + rx_nents)
+			return NULL;
+		if (tx_nents) {
+			tx_sg = seg->sg;
+			sg_init_table(tx_sg, tx_nents);
+		}
+		if (rx_nents) {
+			rx_sg = seg->sg + tx_nents;
+			sg_init_table(rx_sg, rx_nents);
+		}
 
-	/* Response consists only of incoming data */
-	operation = gb_operation_create(connection, GB_SPI_TYPE_TRANSFER,
-					request_size, rx_size, GFP_KERNEL);
+		operation = gb_operation_create_sg(connection,
+						   GB_SPI_TYPE_TRANSFER,
+						   request_size, tx_size,
+						   0, rx_size, GFP_KERNEL);
+		if (operation) {
+			gb_message_set_sg(operation->request, tx_sg, tx_nents);
+			gb_message_set_sg(operation->response, rx_sg, rx_nents);
+		}
+	}
 	if (!operation)
 		return NULL;
 
 	request = operation->request->payload;
-	request->count = cpu_to_le16(count);
+	request->count = cpu_to_le16(seg->count);
 	request->mode = dev->mode;
 	request->chip_select = dev->chip_select;
 
 	gb_xfer = &request->transfers[0];
-	tx_data = gb_xfer + count;	/* place tx data after last gb_xfer */
+	if (seg->copy)
+		tx_data = gb_xfer + seg->count;	/* tx data after last gb_xfer */
+
+	/*
+	 * Fill in the transfers array.  The chip select is left asserted
+	 * across segment boundaries: after a piece of a split transfer, or
+	 * a transfer not ending the message, cs_change takes its meaning for
+	 * the last transfer of a message.
+	 */
+	xfer = seg->xfer;
+	offset = seg->offset;
+	left = seg->len;
+	for (i = 0; i < seg->count; i++) {
+		piece = min(xfer->len - offset, left);
+		last_xfer = list_is_last(&xfer->transfer_list,
+					 &msg->transfers);
 
-	/* Fill in the transfers array */
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
 		gb_xfer->speed_hz = cpu_to_le32(xfer->speed_hz);
-		gb_xfer->len = cpu_to_le32(xfer->len);
-		gb_xfer->delay_usecs = cpu_to_le16(xfer->delay_usecs);
-		gb_xfer->cs_change = xfer->cs_change;
+		gb_xfer->len = cpu_to_le32(piece);
 		gb_xfer->bits_per_word = xfer->bits_per_word;
+		if (offset + piece < xfer->len) {
+			gb_xfer->delay_usecs = 0;
+			gb_xfer->cs_change = 1;
+		} else {
+			gb_xfer->delay_usecs = cpu_to_le16(xfer->delay_usecs);
+			gb_xfer->cs_change = xfer->cs_change;
+			if (i == seg->count - 1 && !last_xfer)
+				gb_xfer->cs_change = !xfer->cs_change;
+		}
 		gb_xfer++;
 
-		/* Copy tx data */
 		if (xfer->tx_buf) {
-			memcpy(tx_data, xfer->tx_buf, xfer->len);
-			tx_data += xfer->len;
+			if (seg->copy) {
+				memcpy(tx_data, xfer->tx_buf + offset, piece);
+				tx_data += piece;
+			} else {
+				tx_sg = gb_spi_sg_fill(tx_sg,
+						       xfer->tx_buf + offset,
+						       piece);
+			}
 		}
+		if (xfer->rx_buf && !seg->copy)
+			rx_sg = gb_spi_sg_fill(rx_sg, xfer->rx_buf + offset,
+					       piece);
+
+		left -= piece;
+		offset = 0;
+		xfer = list_next_entry(xfer, transfer_list);
 	}
 
 	return operation;
 }
 
-static void gb_spi_decode_response(struct spi_message *msg,
+static void gb_spi_decode_response(struct gb_spi_segment *seg,
 				   struct gb_spi_transfer_response *response)
 {
-	struct spi_transfer *xfer;
-	void *rx_data = response->data;
+	struct spi_transfer *xfer = seg->xfer;
+	void *rx_data = response ? response->data : NULL;
+	u32 offset = seg->offset;
+	u32 left = seg->len;
+	u32 piece;
+	int i;
+
+	for (i = 0; i < seg->count; i++) {
+		piece = min(xfer->len - offset, left);
 
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
 		/* Copy rx data */
 		if (xfer->rx_buf) {
-			memcpy(xfer->rx_buf, rx_data, xfer->len);
-			rx_data += xfer->len;
+			memcpy(xfer->rx_buf + offset, rx_data, piece);
+			rx_data += piece;
 		}
+
+		left -= piece;
+		offset = 0;
+		xfer = list_next_entry(xfer, transfer_list);
 	}
 }
 
-static int gb_spi_transfer_one_message(struct spi_master *master,
-				       struct spi_message *msg)
+/*
+ * Retire completed segments.  Segments are retired in the order they were
+ * queued, so a segment completing early is held until all older ones are
+ * done, and messages are given back in order.
+ */
+static void gb_spi_segment_done(struct gb_spi *spi,
+				struct gb_spi_segment *seg, int status)
 {
-	struct gb_spi *spi = spi_master_get_devdata(master);
-	struct gb_connection *connection = spi->connection;
-	struct gb_spi_transfer_response *response;
+	struct gb_spi_segment *tmp;
+	struct spi_message *msg;
+	unsigned long flags;
+	bool removed;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&spi->lock, flags);
+	seg->status = status;
+	list_for_each_entry_safe(seg, tmp, &spi->segments, links) {
+		if (seg->status == -EINPROGRESS)
+			break;
+		list_move_tail(&seg->links, &done);
+		if (seg->operation)
+			spi->inflight_count--;
+
+		msg = seg->msg;
+		if (seg->status && msg->status == -EINPROGRESS)
+			msg->status = seg->status;
+		else if (!seg->status)
+			msg->actual_length += seg->len;
+		if (seg->last && msg->status == -EINPROGRESS)
+			msg->status = 0;
+	}
+	removed = spi->removed;
+	spin_unlock_irqrestore(&spi->lock, flags);
+
+	list_for_each_entry_safe(seg, tmp, &done, links) {
+		msg = seg->msg;
+		if (seg->operation)
+			gb_operation_put(seg->operation);
+		if (seg->last && msg->complete)
+			msg->complete(msg->context);
+		kfree(seg->sg);
+		kfree(seg);
+	}
+
+	if (!removed)
+		schedule_work(&spi->work);
+}
+
+static void gb_spi_transfer_callback(struct gb_operation *operation)
+{
+	struct gb_spi_segment *seg = gb_operation_get_data(operation);
+	struct gb_spi *spi = spi_master_get_devdata(seg->msg->spi->master);
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret) {
+		dev_err(&operation->connection->dev,
+			"transfer operation failed (%d)\n", ret);
+	} else if (seg->copy) {
+		gb_spi_decode_response(seg, operation->response->payload);
+	}
+
+	gb_spi_segment_done(spi, seg, ret);
+}
+
+/* Move the current message's cursor past a segment */
+static void gb_spi_segment_advance(struct gb_spi *spi,
+				   struct gb_spi_segment *seg)
+{
+	struct spi_transfer *xfer = seg->xfer;
+	u32 offset = seg->offset;
+	u32 left = seg->len;
+	u32 piece;
+	int i;
+
+	for (i = 0; i < seg->count; i++) {
+		piece = min(xfer->len - offset, left);
+		left -= piece;
+		offset += piece;
+		if (offset < xfer->len)
+			break;
+
+		if (list_is_last(&xfer->transfer_list, &spi->msg->transfers)) {
+			spi->msg = NULL;
+			return;
+		}
+		xfer = list_next_entry(xfer, transfer_list);
+		offset = 0;
+	}
+
+	spi->xfer = xfer;
+	spi->offset = offset;
+}
+
+/*
+ * Send the next segment of the current message, taking a new message from
+ * the queue if needed.  Returns false when there's nothing left to send.
+ */
+static bool gb_spi_send_segment(struct gb_spi *spi)
+{
+	struct spi_message *msg;
+	struct gb_spi_segment *seg;
 	struct gb_operation *operation;
-	u32 len = 0;
 	int ret;
 
-	operation = gb_spi_operation_create(connection, msg, &len);
-	if (!operation)
-		return -ENOMEM;
+	spin_lock_irq(&spi->lock);
+	if (!spi->msg) {
+		if (list_empty(&spi->queue)) {
+			spin_unlock_irq(&spi->lock);
+			return false;
+		}
+		spi->msg = list_first_entry(&spi->queue, struct spi_message,
+					    queue);
+		list_del_init(&spi->msg->queue);
+		spi->xfer = list_first_entry(&spi->msg->transfers,
+					     struct spi_transfer,
+					     transfer_list);
+		spi->offset = 0;
+	}
+	msg = spi->msg;
+	/* an earlier segment failed; don't send the rest */
+	ret = msg->status == -EINPROGRESS ? 0 : msg->status;
+	spin_unlock_irq(&spi->lock);
+
+	seg = kzalloc(sizeof(*seg), GFP_KERNEL);
+	if (!seg) {
+		/*
+		 * Try again when a segment completes, or give up on the
+		 * message if none will.
+		 */
+		spin_lock_irq(&spi->lock);
+		if (!list_empty(&spi->segments)) {
+			spin_unlock_irq(&spi->lock);
+			return false;
+		}
+		spi->msg = NULL;
+		if (msg->status == -EINPROGRESS)
+			msg->status = -ENOMEM;
+		spin_unlock_irq(&spi->lock);
+
+		if (msg->complete)
+			msg->complete(msg->context);
+		return true;
+	}
+	seg->msg = msg;
+	seg->xfer = spi->xfer;
+	seg->offset = spi->offset;
+	seg->status = -EINPROGRESS;
 
-	ret = gb_operation_request_send_sync(operation);
-	if (!ret) {
-		response = operation->response->payload;
-		if (response)
-			gb_spi_decode_response(msg, response);
-	} else {
-		pr_err("transfer operation failed (%d)\n", ret);
+	if (!ret)
+		ret = gb_spi_segment_size(spi, msg, seg);
+	if (ret) {
+		/* finish the message with an empty segment */
+		seg->len = 0;
+		seg->count = 0;
+		seg->last = true;
+		spi->msg = NULL;
+		spin_lock_irq(&spi->lock);
+		list_add_tail(&seg->links, &spi->segments);
+		spin_unlock_irq(&spi->lock);
+		gb_spi_segment_done(spi, seg, ret);
+		return true;
 	}
-	gb_operation_destroy(operation);
 
-	msg->actual_length = len;
-	msg->status = 0;
-	spi_finalize_current_message(master);
+	/* Advance past the segment */
+	gb_spi_segment_advance(spi, seg);
+	seg->last = !spi->msg;
 
-	return ret;
+	operation = gb_spi_operation_create(spi, msg, seg);
+	if (operation) {
+		seg->operation = operation;
+		gb_operation_set_data(operation, seg);
+	}
+
+	spin_lock_irq(&spi->lock);
+	list_add_tail(&seg->links, &spi->segments);
+	if (operation)
+		spi->inflight_count++;
+	spin_unlock_irq(&spi->lock);
+
+	if (!operation) {
+		gb_spi_segment_done(spi, seg, -ENOMEM);
+		return true;
+	}
+
+	ret = gb_operation_request_send(operation, gb_spi_transfer_callback,
+					GFP_KERNEL);
+	if (ret) {
+		dev_err(&spi->connection->dev,
+			"transfer operation failed (%d)\n", ret);
+		gb_spi_segment_done(spi, seg, ret);
+	}
+
+	return true;
+}
+
+/*
+ * Send queued messages until the transfer window is full.  Each segment
+ * is retired, and each message completed, from an operation callback.
+ */
+static void gb_spi_work(struct work_struct *work)
+{
+	struct gb_spi *spi = container_of(work, struct gb_spi, work);
+	unsigned int window;
+
+	window = 1;
+	if (spi->pipeline)
+		window = clamp_t(unsigned int, ACCESS_ONCE(transfer_window), 1,
+				 GB_SPI_TRANSFER_WINDOW_MAX);
+
+	while (ACCESS_ONCE(spi->inflight_count) < window) {
+		if (!gb_spi_send_segment(spi))
+			break;
+	}
+}
+
+/*
+ * Queue a message for transmission.  This may be called in atomic context,
+ * so the operation is built and sent from gb_spi_work().
+ */
+static int gb_spi_transfer(struct spi_device *dev, struct spi_message *msg)
+{
+	struct gb_spi *spi = spi_master_get_devdata(dev->master);
+	unsigned long flags;
+
+	msg->actual_length = 0;
+	msg->status = -EINPROGRESS;
+	msg->state = NULL;
+
+	spin_lock_irqsave(&spi->lock, flags);
+	if (spi->removed) {
+		spin_unlock_irqrestore(&spi->lock, flags);
+		return -ESHUTDOWN;
+	}
+	list_add_tail(&msg->queue, &spi->queue);
+	schedule_work(&spi->work);
+	spin_unlock_irqrestore(&spi->lock, flags);
+
+	return 0;
+}
+
+#ifdef SPI_HAVE_MAX_TRANSFER_SIZE
+/*
+ * Larger transfers are split if the module supports it, but a transfer
+ * that fits in one operation needn't hold the chip select across
+ * operations.
+ */
+static size_t gb_spi_max_transfer_size(struct spi_device *dev)
+{
+	struct gb_spi *spi = spi_master_get_devdata(dev->master);
+
+	return spi->payload_max - sizeof(struct gb_spi_transfer_request) -
+		sizeof(struct gb_spi_transfer);
+}
+#endif
+
+#ifdef SPI_HAVE_MAX_MESSAGE_SIZE
+/*
+ * Modules that can't take split messages need the whole message in one
+ * operation, which holds at most this much data.
+ */
+static size_t gb_spi_max_message_size(struct spi_device *dev)
+{
+	return gb_spi_max_transfer_size(dev);
 }
+#endif
 
 static int gb_spi_setup(struct spi_device *spi)
 {
@@ -295,10 +788,20 @@ static int gb_spi_connection_init(struct gb_connection *connection)
 	spi->connection = connection;
 	connection->private = master;
 
+	spin_lock_init(&spi->lock);
+	INIT_LIST_HEAD(&spi->queue);
+	INIT_LIST_HEAD(&spi->segments);
+	INIT_WORK(&spi->work, gb_spi_work);
+
 	ret = gb_spi_init(spi);
 	if (ret)
 		goto out_err;
 
+	spi->payload_max = gb_operation_get_payload_size_max(connection);
+	spi->split = connection->module_minor >= GB_SPI_VERSION_MINOR_SPLIT;
+	spi->pipeline = connection->module_minor >=
+					GB_SPI_VERSION_MINOR_WINDOW;
+
 	master->bus_num = -1; /* Allow spi-core to allocate it dynamically */
 	master->num_chipselect = spi->num_chipselect;
 	master->mode_bits = spi->mode;
@@ -308,7 +811,14 @@ static int gb_spi_connection_init(struct gb_connection *connection)
 	/* Attach methods */
 	master->cleanup = gb_spi_cleanup;
 	master->setup = gb_spi_setup;
-	master->transfer_one_message = gb_spi_transfer_one_message;
+	master->transfer = gb_spi_transfer;
+#ifdef SPI_HAVE_MAX_TRANSFER_SIZE
+	master->max_transfer_size = gb_spi_max_transfer_size;
+#endif
+#ifdef SPI_HAVE_MAX_MESSAGE_SIZE
+	if (!spi->split)
+		master->max_message_size = gb_spi_max_message_size;
+#endif
 
 	ret = spi_register_master(master);
 	if (!ret)
@@ -323,8 +833,39 @@ out_err:
 static void gb_spi_connection_exit(struct gb_connection *connection)
 {
 	struct spi_master *master = connection->private;
+	struct gb_spi *spi = spi_master_get_devdata(master);
+	struct spi_message *msg, *tmp;
+	LIST_HEAD(queue);
 
+	/*
+	 * Keep the master around until the work is gone.  All operations
+	 * have been cancelled by now, so the messages of spi devices going
+	 * away with the master fail quickly.
+	 */
+	spi_master_get(master);
 	spi_unregister_master(master);
+
+	spin_lock_irq(&spi->lock);
+	spi->removed = true;
+	list_splice_init(&spi->queue, &queue);
+	spin_unlock_irq(&spi->lock);
+
+	cancel_work_sync(&spi->work);
+
+	/* Nothing is in flight, so fail whatever was never sent */
+	if (spi->msg) {
+		list_add(&spi->msg->queue, &queue);
+		spi->msg = NULL;
+	}
+	list_for_each_entry_safe(msg, tmp, &queue, queue) {
+		list_del_init(&msg->queue);
+		if (msg->status == -EINPROGRESS)
+			msg->status = -ESHUTDOWN;
+		if (msg->complete)
+			msg->complete(msg->context);
+	}
+
+	spi_master_put(master);
 }
 
 static struct gb_protocol spi_protocol = {
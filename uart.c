@@ -27,12 +27,25 @@
 #include <linux/idr.h>
 #include <linux/fs.h>
 #include <linux/kdev_t.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
 
 #include "greybus.h"
 
 #define GB_NUM_MINORS	16	/* 16 is is more than enough */
 #define GB_NAME		"ttyGB"
 
+#define GB_UART_WRITE_FIFO_SIZE		PAGE_SIZE
+#define GB_UART_TX_INFLIGHT_MAX		4	/* send operations in flight */
+#define GB_UART_TX_CREDIT_TIMEOUT	HZ	/* wait for a flow status */
+
+/*
+ * Unless in low-latency mode, received data is pushed to the line discipline
+ * once this much has accumulated, or after a jiffy at most.
+ */
+#define GB_UART_RX_COALESCE_BYTES	512
+#define GB_UART_RX_COALESCE_DELAY	1	/* jiffies */
+
 struct gb_tty_line_coding {
 	__le32	rate;
 	__u8	format;
@@ -42,7 +55,6 @@ struct gb_tty_line_coding {
 
 struct gb_tty {
 	struct tty_port port;
-	void *buffer;
 	u32 buffer_payload_max;
 	struct gb_connection *connection;
 	u16 cport_id;
@@ -58,6 +70,42 @@ struct gb_tty {
 	u8 ctrlin;	/* input control lines */
 	u8 ctrlout;	/* output control lines */
 	struct gb_tty_line_coding line_coding;
+
+	/*
+	 * Data written to the tty is buffered in write_fifo and drained by
+	 * tx_work into up to tx_window send operations: GB_UART_TX_INFLIGHT_MAX
+	 * for modules that queue them, one otherwise.  write_lock protects
+	 * the fifo and the in-flight accounting.
+	 */
+	struct work_struct tx_work;
+	struct kfifo write_fifo;
+	unsigned int tx_window;
+	unsigned int tx_inflight;
+	unsigned int tx_inflight_bytes;
+
+	/*
+	 * Modules supporting flow control throttle us out of band instead of
+	 * with in-band XON/XOFF, and report how much more data they can take
+	 * in tx_credits (negative until the first report: no limit).  If
+	 * we run out and no report follows, tx_credit_work stops limiting
+	 * us rather than stalling for good.
+	 */
+	bool flow_control;
+	int tx_credits;
+	struct delayed_work tx_credit_work;
+
+	/*
+	 * In low-latency mode received data is delivered straight from the
+	 * receive context, otherwise back-to-back messages are coalesced and
+	 * pushed together by rx_push_work.  read_lock serialises access to
+	 * the flip buffer between the two.  rx_deferred counts received
+	 * data messages left to the connection workqueue; while there are
+	 * any, newer data must follow them there to keep its order.
+	 */
+	bool low_latency;
+	unsigned int rx_deferred;
+	unsigned int rx_unpushed;
+	struct delayed_work rx_push_work;
 };
 
 static struct tty_driver *gb_tty_driver;
@@ -65,61 +113,165 @@ static DEFINE_IDR(tty_minors);
 static DEFINE_MUTEX(table_lock);
 static atomic_t reference_count = ATOMIC_INIT(0);
 
+static void gb_uart_rx_push_work(struct work_struct *work)
+{
+	struct gb_tty *gb_tty = container_of(work, struct gb_tty,
+					     rx_push_work.work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	gb_tty->rx_unpushed = 0;
+	tty_flip_buffer_push(&gb_tty->port);
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+}
+
+/*
+ * Called from the connection workqueue, or from the receive context in
+ * low-latency mode.
+ */
 static int gb_uart_receive_data(struct gb_tty *gb_tty,
 				struct gb_connection *connection,
-				struct gb_uart_recv_data_request *receive_data)
+				struct gb_message *request)
 {
+	struct gb_uart_recv_data_request *receive_data = request->payload;
 	struct tty_port *port = &gb_tty->port;
 	u16 recv_data_size;
 	int count;
 	unsigned long tty_flags = TTY_NORMAL;
+	unsigned long flags;
+
+	if (request->payload_size < sizeof(*receive_data))
+		return -EINVAL;
 
 	count = gb_tty->buffer_payload_max - sizeof(*receive_data);
 	recv_data_size = le16_to_cpu(receive_data->size);
-	if (!recv_data_size || recv_data_size > count)
+	if (!recv_data_size || recv_data_size > count ||
+	    recv_data_size > request->payload_size - sizeof(*receive_data))
 		return -EINVAL;
 
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+
 	if (receive_data->flags) {
-		if (receive_data->flags & GB_UART_RECV_FLAG_BREAK)
+		if (receive_data->flags & GB_UART_RECV_FLAG_BREAK) {
 			tty_flags = TTY_BREAK;
-		else if (receive_data->flags & GB_UART_RECV_FLAG_PARITY)
+			gb_tty->iocount.brk++;
+		} else if (receive_data->flags & GB_UART_RECV_FLAG_PARITY) {
 			tty_flags = TTY_PARITY;
-		else if (receive_data->flags & GB_UART_RECV_FLAG_FRAMING)
+			gb_tty->iocount.parity++;
+		} else if (receive_data->flags & GB_UART_RECV_FLAG_FRAMING) {
 			tty_flags = TTY_FRAME;
+			gb_tty->iocount.frame++;
+		}
 
 		/* overrun is special, not associated with a char */
-		if (receive_data->flags & GB_UART_RECV_FLAG_OVERRUN)
+		if (receive_data->flags & GB_UART_RECV_FLAG_OVERRUN) {
 			tty_insert_flip_char(port, 0, TTY_OVERRUN);
+			gb_tty->iocount.overrun++;
+		}
 	}
 	count = tty_insert_flip_string_fixed_flag(port, receive_data->data,
 						  tty_flags, recv_data_size);
+	gb_tty->iocount.rx += count;
 	if (count != recv_data_size) {
-		dev_err(&connection->dev,
+		gb_tty->iocount.buf_overrun++;
+		dev_err_ratelimited(&connection->dev,
 			"UART: RX 0x%08x bytes only wrote 0x%08x\n",
 			recv_data_size, count);
 	}
-	if (count)
-		tty_flip_buffer_push(port);
+
+	if (count) {
+		gb_tty->rx_unpushed += count;
+		if (gb_tty->low_latency ||
+		    gb_tty->rx_unpushed >= GB_UART_RX_COALESCE_BYTES) {
+			gb_tty->rx_unpushed = 0;
+			tty_flip_buffer_push(port);
+		} else {
+			schedule_delayed_work(&gb_tty->rx_push_work,
+					      GB_UART_RX_COALESCE_DELAY);
+		}
+	}
+
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
 	return 0;
 }
 
+/*
+ * In low-latency mode, deliver received data without waiting for the
+ * connection workqueue, unless earlier data is still queued there.  Anything
+ * else, including malformed data, is left to gb_uart_request_recv().
+ */
+static bool gb_uart_request_recv_atomic(u8 type, struct gb_operation *op)
+{
+	struct gb_connection *connection = op->connection;
+	struct gb_tty *gb_tty = connection->private;
+	unsigned long flags;
+	bool direct;
+
+	if (type != GB_UART_TYPE_RECEIVE_DATA || !gb_tty)
+		return false;
+
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	direct = gb_tty->low_latency && !gb_tty->rx_deferred;
+	if (!direct)
+		gb_tty->rx_deferred++;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
+	if (!direct)
+		return false;
+
+	if (!gb_uart_receive_data(gb_tty, connection, op->request))
+		return true;
+
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	gb_tty->rx_deferred++;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
+	return false;
+}
+
 static int gb_uart_request_recv(u8 type, struct gb_operation *op)
 {
 	struct gb_connection *connection = op->connection;
 	struct gb_tty *gb_tty = connection->private;
 	struct gb_message *request = op->request;
 	struct gb_uart_serial_state_request *serial_state;
+	struct gb_uart_flow_status_request *flow_status;
+	unsigned long flags;
+	int tx_free;
 	int ret = 0;
 
 	switch (type) {
 	case GB_UART_TYPE_RECEIVE_DATA:
-		ret = gb_uart_receive_data(gb_tty, connection,
-					   request->payload);
+		ret = gb_uart_receive_data(gb_tty, connection, request);
+
+		spin_lock_irqsave(&gb_tty->read_lock, flags);
+		if (gb_tty->rx_deferred)
+			gb_tty->rx_deferred--;
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
 		break;
 	case GB_UART_TYPE_SERIAL_STATE:
 		serial_state = request->payload;
 		gb_tty->ctrlin = serial_state->control;
 		break;
+	case GB_UART_TYPE_FLOW_STATUS:
+		if (!gb_tty->flow_control ||
+		    request->payload_size < sizeof(*flow_status)) {
+			ret = -EINVAL;
+			break;
+		}
+		flow_status = request->payload;
+
+		/* The module hadn't seen the data still in flight yet */
+		spin_lock_irqsave(&gb_tty->write_lock, flags);
+		tx_free = le16_to_cpu(flow_status->tx_free);
+		tx_free -= (int)gb_tty->tx_inflight_bytes;
+		gb_tty->tx_credits = max(tx_free, 0);
+		spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+		cancel_delayed_work(&gb_tty->tx_credit_work);
+		schedule_work(&gb_tty->tx_work);
+		break;
 	default:
 		dev_err(&connection->dev,
 			"unsupported unsolicited request: %02x\n", type);
@@ -129,25 +281,140 @@ static int gb_uart_request_recv(u8 type, struct gb_operation *op)
 	return ret;
 }
 
-static int send_data(struct gb_tty *tty, u16 size, const u8 *data)
+static void gb_uart_send_data_callback(struct gb_operation *operation)
+{
+	struct gb_tty *gb_tty = operation->connection->private;
+	struct gb_uart_send_data_request *request = operation->request->payload;
+	unsigned long flags;
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret) {
+		dev_err_ratelimited(&operation->connection->dev,
+				    "send data failed: %d\n", ret);
+	}
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	gb_tty->tx_inflight--;
+	gb_tty->tx_inflight_bytes -= le16_to_cpu(request->size);
+	if (!ret)
+		gb_tty->iocount.tx += le16_to_cpu(request->size);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	tty_port_tty_wakeup(&gb_tty->port);
+	schedule_work(&gb_tty->tx_work);
+
+	gb_operation_put(operation);
+}
+
+/*
+ * Called when we have been out of credits with nothing in flight for
+ * GB_UART_TX_CREDIT_TIMEOUT.  The flow status report that should have
+ * followed was lost, so send without a limit until the next one.
+ */
+static void gb_uart_tx_credit_work(struct work_struct *work)
+{
+	struct gb_tty *gb_tty = container_of(work, struct gb_tty,
+					     tx_credit_work.work);
+	unsigned long flags;
+	bool stalled;
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	stalled = !gb_tty->tx_credits;
+	if (stalled)
+		gb_tty->tx_credits = -1;
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	if (!stalled || gb_tty->disconnected)
+		return;
+
+	dev_warn_ratelimited(&gb_tty->connection->dev,
+			     "no flow status from module, resuming transmit\n");
+	schedule_work(&gb_tty->tx_work);
+}
+
+/*
+ * Drain the write fifo into asynchronous send operations, keeping up to
+ * tx_window of them in flight.  The fifo may be flushed
+ * while an operation is being created, so each message carries only what
+ * was actually taken out of it.
+ */
+static void gb_uart_tx_write_work(struct work_struct *work)
 {
+	struct gb_tty *gb_tty = container_of(work, struct gb_tty, tx_work);
 	struct gb_uart_send_data_request *request;
+	struct gb_operation *operation;
+	unsigned long flags;
+	unsigned int size;
+	bool stalled;
 	int ret;
 
-	if (!data || !size)
-		return 0;
+	while (1) {
+		spin_lock_irqsave(&gb_tty->write_lock, flags);
+		if (gb_tty->tx_inflight >= gb_tty->tx_window) {
+			spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+			break;
+		}
+		size = min_t(unsigned int, kfifo_len(&gb_tty->write_fifo),
+			     gb_tty->buffer_payload_max - sizeof(*request));
+		if (gb_tty->tx_credits >= 0)
+			size = min_t(unsigned int, size, gb_tty->tx_credits);
+		stalled = !gb_tty->tx_credits && !gb_tty->tx_inflight &&
+			  !kfifo_is_empty(&gb_tty->write_fifo);
+		spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+		if (stalled)
+			schedule_delayed_work(&gb_tty->tx_credit_work,
+					      GB_UART_TX_CREDIT_TIMEOUT);
+		if (!size)
+			break;
 
-	if (size > tty->buffer_payload_max)
-		size = tty->buffer_payload_max;
-	request = tty->buffer;
-	request->size = cpu_to_le16(size);
-	memcpy(&request->data[0], data, size);
-	ret = gb_operation_sync(tty->connection, GB_UART_TYPE_SEND_DATA,
-				request, sizeof(*request) + size, NULL, 0);
-	if (ret)
-		return ret;
-	else
-		return size;
+		operation = gb_operation_create(gb_tty->connection,
+						GB_UART_TYPE_SEND_DATA,
+						sizeof(*request) + size, 0,
+						GFP_KERNEL);
+		if (!operation)
+			break;
+
+		request = operation->request->payload;
+
+		spin_lock_irqsave(&gb_tty->write_lock, flags);
+		size = kfifo_out(&gb_tty->write_fifo, &request->data[0], size);
+		if (size) {
+			if (gb_tty->tx_credits >= 0)
+				gb_tty->tx_credits -= size;
+			gb_tty->tx_inflight++;
+			gb_tty->tx_inflight_bytes += size;
+		}
+		spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+		if (!size) {
+			gb_operation_destroy(operation);
+			break;
+		}
+
+		request->size = cpu_to_le16(size);
+		gb_message_trim_payload(operation->request,
+					sizeof(*request) + size);
+
+		tty_port_tty_wakeup(&gb_tty->port);
+
+		ret = gb_operation_request_send(operation,
+						gb_uart_send_data_callback,
+						GFP_KERNEL);
+		if (ret) {
+			dev_err(&gb_tty->connection->dev,
+				"failed to send data: %d\n", ret);
+
+			spin_lock_irqsave(&gb_tty->write_lock, flags);
+			gb_tty->tx_inflight--;
+			gb_tty->tx_inflight_bytes -= size;
+			spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+			gb_operation_destroy(operation);
+			break;
+		}
+	}
 }
 
 static int send_line_coding(struct gb_tty *tty)
@@ -170,6 +437,91 @@ static int send_control(struct gb_tty *gb_tty, u8 control)
 				 &request, sizeof(request), NULL, 0);
 }
 
+static void gb_uart_flow_control_callback(struct gb_operation *operation)
+{
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret) {
+		dev_err_ratelimited(&operation->connection->dev,
+				    "flow control failed: %d\n", ret);
+	}
+
+	gb_operation_put(operation);
+}
+
+/*
+ * Ask the module to stop or resume sending data.  This is done
+ * asynchronously so that throttling takes effect as soon as possible
+ * without waiting for the module.
+ */
+static int send_flow_control(struct gb_tty *gb_tty, u8 state)
+{
+	struct gb_uart_flow_control_request *request;
+	struct gb_operation *operation;
+	int ret;
+
+	operation = gb_operation_create(gb_tty->connection,
+					GB_UART_TYPE_FLOW_CONTROL,
+					sizeof(*request), 0, GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
+	request->state = state;
+
+	ret = gb_operation_request_send(operation,
+					gb_uart_flow_control_callback,
+					GFP_KERNEL);
+	if (ret)
+		gb_operation_destroy(operation);
+
+	return ret;
+}
+
+static void gb_uart_send_xchar_callback(struct gb_operation *operation)
+{
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret) {
+		dev_err_ratelimited(&operation->connection->dev,
+				    "send xchar failed: %d\n", ret);
+	}
+
+	gb_operation_put(operation);
+}
+
+/*
+ * Send a flow control character straight away, ahead of any data still
+ * buffered or in flight, so that software flow control takes effect
+ * promptly.
+ */
+static int send_xchar(struct gb_tty *gb_tty, char ch)
+{
+	struct gb_uart_send_data_request *request;
+	struct gb_operation *operation;
+	int ret;
+
+	operation = gb_operation_create(gb_tty->connection,
+					GB_UART_TYPE_SEND_DATA,
+					sizeof(*request) + 1, 0, GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
+	request->size = cpu_to_le16(1);
+	request->data[0] = ch;
+
+	ret = gb_operation_request_send(operation,
+					gb_uart_send_xchar_callback,
+					GFP_KERNEL);
+	if (ret)
+		gb_operation_destroy(operation);
+
+	return ret;
+}
+
 static int send_break(struct gb_tty *gb_tty, u8 state)
 {
 	struct gb_uart_set_break_request request;
@@ -281,19 +633,50 @@ static int gb_tty_write(struct tty_struct *tty, const unsigned char *buf,
 {
 	struct gb_tty *gb_tty = tty->driver_data;
 
-	return send_data(gb_tty, count, buf);
+	count = kfifo_in_spinlocked(&gb_tty->write_fifo, buf, count,
+				    &gb_tty->write_lock);
+	if (count)
+		schedule_work(&gb_tty->tx_work);
+
+	return count;
 }
 
 static int gb_tty_write_room(struct tty_struct *tty)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+	int room;
 
-	return gb_tty->buffer_payload_max;
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	room = kfifo_avail(&gb_tty->write_fifo);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	return room;
 }
 
 static int gb_tty_chars_in_buffer(struct tty_struct *tty)
 {
-	return 0;
+	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+	int chars;
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	chars = kfifo_len(&gb_tty->write_fifo) + gb_tty->tx_inflight_bytes;
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	return chars;
+}
+
+static void gb_tty_flush_buffer(struct tty_struct *tty)
+{
+	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	kfifo_reset_out(&gb_tty->write_fifo);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	tty_port_tty_wakeup(&gb_tty->port);
 }
 
 static int gb_tty_break_ctl(struct tty_struct *tty, int state)
@@ -386,16 +769,26 @@ static int gb_tty_tiocmset(struct tty_struct *tty, unsigned int set,
 	return send_control(gb_tty, newctrl);
 }
 
+static void gb_tty_send_xchar(struct tty_struct *tty, char ch)
+{
+	struct gb_tty *gb_tty = tty->driver_data;
+
+	send_xchar(gb_tty, ch);
+}
+
 static void gb_tty_throttle(struct tty_struct *tty)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
-	unsigned char stop_char;
 	int retval;
 
+	if (gb_tty->flow_control) {
+		send_flow_control(gb_tty, GB_UART_FLOW_STOP);
+		return;
+	}
+
 	if (I_IXOFF(tty)) {
-		stop_char = STOP_CHAR(tty);
-		retval = gb_tty_write(tty, &stop_char, 1);
-		if (retval <= 0)
+		retval = send_xchar(gb_tty, STOP_CHAR(tty));
+		if (retval)
 			return;
 	}
 
@@ -409,13 +802,16 @@ static void gb_tty_throttle(struct tty_struct *tty)
 static void gb_tty_unthrottle(struct tty_struct *tty)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
-	unsigned char start_char;
 	int retval;
 
+	if (gb_tty->flow_control) {
+		send_flow_control(gb_tty, GB_UART_FLOW_RESUME);
+		return;
+	}
+
 	if (I_IXOFF(tty)) {
-		start_char = START_CHAR(tty);
-		retval = gb_tty_write(tty, &start_char, 1);
-		if (retval <= 0)
+		retval = send_xchar(gb_tty, START_CHAR(tty));
+		if (retval)
 			return;
 	}
 
@@ -434,7 +830,9 @@ static int get_serial_info(struct gb_tty *gb_tty,
 		return -EINVAL;
 
 	memset(&tmp, 0, sizeof(tmp));
-	tmp.flags = ASYNC_LOW_LATENCY | ASYNC_SKIP_TEST;
+	tmp.flags = ASYNC_SKIP_TEST;
+	if (gb_tty->low_latency)
+		tmp.flags |= ASYNC_LOW_LATENCY;
 	tmp.type = PORT_16550A;
 	tmp.line = gb_tty->minor;
 	tmp.xmit_fifo_size = 16;
@@ -473,6 +871,7 @@ static int set_serial_info(struct gb_tty *gb_tty,
 	} else {
 		gb_tty->port.close_delay = close_delay;
 		gb_tty->port.closing_wait = closing_wait;
+		gb_tty->low_latency = !!(new_serial.flags & ASYNC_LOW_LATENCY);
 	}
 	mutex_unlock(&gb_tty->port.mutex);
 	return retval;
@@ -525,6 +924,9 @@ static int get_serial_usage(struct gb_tty *gb_tty,
 	int retval = 0;
 
 	memset(&icount, 0, sizeof(icount));
+	icount.rx = gb_tty->iocount.rx;
+	icount.tx = gb_tty->iocount.tx;
+	icount.buf_overrun = gb_tty->iocount.buf_overrun;
 	icount.dsr = gb_tty->iocount.dsr;
 	icount.rng = gb_tty->iocount.rng;
 	icount.dcd = gb_tty->iocount.dcd;
@@ -571,9 +973,11 @@ static const struct tty_operations gb_ops = {
 	.write =		gb_tty_write,
 	.write_room =		gb_tty_write_room,
 	.ioctl =		gb_tty_ioctl,
+	.send_xchar =		gb_tty_send_xchar,
 	.throttle =		gb_tty_throttle,
 	.unthrottle =		gb_tty_unthrottle,
 	.chars_in_buffer =	gb_tty_chars_in_buffer,
+	.flush_buffer =		gb_tty_flush_buffer,
 	.break_ctl =		gb_tty_break_ctl,
 	.set_termios =		gb_tty_set_termios,
 	.tiocmget =		gb_tty_tiocmget,
@@ -614,12 +1018,29 @@ static int gb_uart_connection_init(struct gb_connection *connection)
 		goto error_payload;
 	}
 
-	gb_tty->buffer = kzalloc(gb_tty->buffer_payload_max, GFP_KERNEL);
-	if (!gb_tty->buffer) {
-		retval = -ENOMEM;
+	if (gb_tty->buffer_payload_max <=
+			sizeof(struct gb_uart_send_data_request)) {
+		retval = -EINVAL;
 		goto error_payload;
 	}
 
+	INIT_WORK(&gb_tty->tx_work, gb_uart_tx_write_work);
+	INIT_DELAYED_WORK(&gb_tty->rx_push_work, gb_uart_rx_push_work);
+	INIT_DELAYED_WORK(&gb_tty->tx_credit_work, gb_uart_tx_credit_work);
+	gb_tty->low_latency = true;
+	gb_tty->flow_control = connection->module_minor >=
+					GB_UART_VERSION_MINOR_FLOW_CONTROL;
+	gb_tty->tx_credits = -1;
+	if (connection->module_minor >= GB_UART_VERSION_MINOR_TX_WINDOW)
+		gb_tty->tx_window = GB_UART_TX_INFLIGHT_MAX;
+	else
+		gb_tty->tx_window = 1;
+
+	retval = kfifo_alloc(&gb_tty->write_fifo, GB_UART_WRITE_FIFO_SIZE,
+			     GFP_KERNEL);
+	if (retval)
+		goto error_payload;
+
 	gb_tty->connection = connection;
 	connection->private = gb_tty;
 
@@ -666,7 +1087,7 @@ error:
 	release_minor(gb_tty);
 error_minor:
 	connection->private = NULL;
-	kfree(gb_tty->buffer);
+	kfifo_free(&gb_tty->write_fifo);
 error_payload:
 	kfree(gb_tty);
 error_alloc:
@@ -696,6 +1117,9 @@ static void gb_uart_connection_exit(struct gb_connection *connection)
 		tty_kref_put(tty);
 	}
 	/* FIXME - stop all traffic */
+	cancel_work_sync(&gb_tty->tx_work);
+	cancel_delayed_work_sync(&gb_tty->tx_credit_work);
+	cancel_delayed_work_sync(&gb_tty->rx_push_work);
 
 	tty_unregister_device(gb_tty_driver, gb_tty->minor);
 
@@ -703,7 +1127,7 @@ static void gb_uart_connection_exit(struct gb_connection *connection)
 
 	tty_port_put(&gb_tty->port);
 	tty_port_destroy(&gb_tty->port);
-	kfree(gb_tty->buffer);
+	kfifo_free(&gb_tty->write_fifo);
 	kfree(gb_tty);
 
 	/* If last device is gone, tear down the tty structures */
@@ -762,6 +1186,7 @@ static struct gb_protocol uart_protocol = {
 	.connection_init	= gb_uart_connection_init,
 	.connection_exit	= gb_uart_connection_exit,
 	.request_recv		= gb_uart_request_recv,
+	.request_recv_atomic	= gb_uart_request_recv_atomic,
 };
 
 gb_builtin_protocol_driver(uart_protocol);